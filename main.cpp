@@ -1,54 +1,963 @@
 #include <iostream>
 #include <vector>
-#include <list>
+#include <cstdint>
 #include <cstdlib>
+#include <cerrno>
 #include <ctime>
 #include <string>
+#include <algorithm>
+#include <climits>
+#include <string_view>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <array>
+#include <utility>
+#include <iterator>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <semaphore>
+#include <atomic>
+#include <memory>
+#include <coroutine>
+#include <omp.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 // GLOBAL Data Types ---
 
-enum Status { READY, BLOCKED, FINISHED };
+enum Status : uint8_t { READY, BLOCKED, FINISHED };
+enum ProcType : uint8_t { READER, WRITER };
 
-struct Process {
-    int id;
-    int program_counter;
-    int type;
-    Status status;
+// Process table as structure-of-arrays: pid is the index into every array, so a
+// pass over one field (e.g. status) stays dense even with millions of actors.
+struct ProcessTable {
+    vector<int> program_counter;
+    vector<Status> status;
+    vector<ProcType> type;
+    vector<int> wait_next; // link to the next pid in the same WaitQueue (-1 = none)
+    vector<int> wait_prev; // ... and to the previous one, so a timed-out wait unlinks in O(1)
+    vector<uint8_t> waiting_on; // SemId a BLOCKED pid waits on (SEM_NONE otherwise)
+
+    int size() const { return (int) type.size(); }
+};
+
+enum TraceMode : uint8_t { TRACE_NONE, TRACE_BINARY, TRACE_TEXT };
+
+struct Protocol;
+
+// Virtual time an instruction takes under --clock: uniform in [lo, hi].
+struct Duration {
+    long lo = 1;
+    long hi = 1;
+};
+
+// Longest --duration. A process would need 2^31 steps this long before
+// sim.now + a duration (or a --timeout) could overflow virtual time.
+const long MAX_DURATION = UINT32_MAX;
+
+// Which BLOCKED process a SemSignal wakes, per semaphore (--wake).
+enum WakePolicy : uint8_t { WAKE_FIFO, WAKE_LIFO, WAKE_WRITERS_FIRST, WAKE_RANDOM, WAKE_POLICY_COUNT };
+const char *const WAKE_POLICY_NAMES[] = {"fifo", "lifo", "writers-first", "random"};
+
+// Largest population, readers and writers together, so pids and counts stay ints.
+const long MAX_PROCESSES = 1 << 28;
+
+// Startup configuration: population, reader_limiter capacity and batch size.
+struct Config {
+    int readers = 3;
+    int writers = 3;
+    int reader_limit = 2;
+    long trials = 0; // 0 = single traced run, N = batch of N untraced trials
+    bool explore = false; // enumerate every interleaving instead of sampling
+    bool dpor = false;    // like explore, but skip orderings of independent steps
+    bool threads = false; // run every process on a real thread instead of simulating
+    long rounds = 10000;  // threads: times each thread runs its program
+    TraceMode trace = TRACE_BINARY; // event sink of a single run
+    string trace_file = "trace.bin";
+    string decode_file;   // non-empty: print this binary trace as text and exit
+    string record_file;   // single run: save every scheduler pick here
+    string replay_file;   // single run: take the picks from this recording instead of the RNG
+    long stop_at = -1;    // replay: stop at this step and print the state
+    string snapshot_file; // single run: save the whole state here at snapshot_at
+    long snapshot_at = 0;
+    string restore_file;  // single run: continue from this snapshot instead of the initial state
+    string sweep;         // "csv" or "json": one batch per grid point, one row each
+    vector<int> sweep_readers, sweep_writers, sweep_limits; // --axis values; empty = the single value above
+    vector<bool> sweep_run_to_block; // policy axis: random picks or run-to-block
+    bool run_to_block = false; // one scheduler pick runs a whole atomic block of steps
+    uint64_t seed = 0;
+    bool seed_given = false; // otherwise seeded from the clock (and printed)
+    long trial = 0;       // single run: replay this trial of a batch with the same seed
+    bool coroutines = false; // built-in programs as C++ coroutines instead of instruction tables
+    bool lanes = false;   // batch: run LANES trials at a time in SIMD lockstep
+    bool clock = false;   // discrete-event engine: instructions take durations[op] of virtual time
+    array<Duration, 16> durations; // indexed by Op
+    long wait_timeout = 100; // virtual time a protocol's "wait_timed S timeout ..." waits
+    vector<string> wake;     // --wake SEM|all=POLICY as given, resolved into wake_policy once names are known
+    array<WakePolicy, 32> wake_policy{}; // indexed by SemId, FIFO unless --wake says otherwise
+    bool compare_wake = false; // batch once per wake policy and compare wait percentiles
+    string protocol_file; // non-empty: run the programs in this protocol file
+    const Protocol *protocol = nullptr; // loaded protocol_file, nullptr = built-in programs
+};
+
+// Built-in semaphores; a protocol file's extra semaphores get ids from SEM_BUILTIN_COUNT up.
+enum SemId : uint8_t { SEM_READ_COUNT_LOCK, SEM_WRT, SEM_READER_LIMITER, SEM_BUILTIN_COUNT, SEM_NONE = 255 };
+const char *const SEM_NAMES[] = {"read_count_lock", "wrt", "reader_limiter"};
+const int MAX_SEMAPHORES = 32; // built-in plus protocol file ones; a set of them fits a uint32_t
+static_assert(MAX_SEMAPHORES == size(Config{}.wake_policy));
+
+// FIFO of BLOCKED pids, linked through ProcessTable::wait_next. A
+// process waits on at most one semaphore at a time, so the links are
+// preallocated with the table and blocking or waking never allocates.
+struct WaitQueue {
+    int head = -1;
+    int tail = -1;
+    int size = 0;
+    int last_writer = -1; // WAKE_WRITERS_FIRST: the queued writers come first, this one last
+
+    bool empty() const { return size == 0; }
 };
 
 struct SimSemaphore {
     int value;
-    list<int> wait_queue;
+    WaitQueue wait_queue;
+    string name;
+    SemId id;
+    WakePolicy policy = WAKE_FIFO;
+};
+
+// State variables invariants and DPOR footprints refer to, as bits of a
+// uint64_t: semaphore s -> bit s, shared variable v -> bit 32 + v, CS counters -> 62/63.
+const int VAR_SHARED_BASE = 32;
+const int VAR_ACTIVE_READERS = 62;
+const int VAR_ACTIVE_WRITERS = 63;
+
+constexpr uint64_t var_bit(int var) { return 1ull << var; }
+
+struct Simulation;
+
+// One value of a protocol file's "invariant NAME LHS OP RHS".
+enum TermKind : uint8_t { TERM_CONSTANT, TERM_LIMIT, TERM_VAR };
+enum Compare : uint8_t { CMP_LE, CMP_LT, CMP_GE, CMP_GT, CMP_EQ, CMP_NE };
+
+struct InvariantTerm {
+    TermKind kind = TERM_CONSTANT;
+    int value = 0; // the constant, or the state variable for TERM_VAR
+};
+
+// A safety rule over the state, re-checked after any step that changes one
+// of the variables it depends on.
+struct Invariant {
     string name;
+    uint64_t depends = 0; // state variable bits holds() reads
+    bool (*holds)(const Simulation &sim, const Invariant &self) = nullptr;
+    InvariantTerm lhs = {}, rhs = {}; // operands of a protocol file comparison
+    Compare compare = CMP_LE;
+};
+
+// Registered invariants plus, per state variable, the invariants to re-check
+// when it changes; at most 64 so a set of them fits one bitmask.
+const int MAX_INVARIANTS = 64;
+
+struct InvariantSet {
+    vector<Invariant> invariants;
+    uint64_t watched = 0;        // every variable some invariant depends on
+    uint64_t affected[64] = {};  // variable -> invariants that depend on it
+    uint64_t related[64] = {};   // variable -> variables read together with it by some invariant
+};
+
+// Everything the simulator used to print, as one fixed-size binary record.
+enum EventKind : uint8_t {
+    EV_BLOCKED, EV_UNBLOCKED,
+    EV_WRITER_ENTER, EV_READER_ENTER, EV_READER_BUSY,
+    EV_WRITER_FINISHED, EV_READER_FINISHED,
+    EV_PANIC, EV_DEADLOCK,
+    EV_WAITS_FOR,
+    EV_TIMED_OUT
+};
+
+// value/extra: readers/writers in CS for ENTER and PANIC; remaining processes and
+// the number of WAITS_FOR records that follow for DEADLOCK; for WAITS_FOR, pid
+// waits on sem for the process in value (-1: nobody left can signal it).
+struct TraceRecord {
+    uint64_t step;
+    int32_t pid;
+    uint8_t kind;
+    uint8_t sem;
+    uint16_t detail; // PANIC: index of the violated invariant
+    int32_t value;
+    int32_t extra;
+};
+static_assert(sizeof(TraceRecord) == 24, "trace records are written as raw bytes");
+
+// Trace sink. Binary records or rendered text collect in memory and go out in
+// large fwrite()s; nothing is flushed per event.
+struct Trace {
+    TraceMode mode = TRACE_NONE;
+    FILE *out = nullptr;
+    vector<TraceRecord> records;
+    string text;
+    long events = 0;
+    const vector<string> *sem_names = nullptr; // a protocol file's names, for text output
+    const InvariantSet *invariants = nullptr;  // names of the invariants PANIC records refer to
+};
+
+// READY set: dense list of runnable pids + each pid's slot in it (-1 if absent).
+// Add/remove are O(1) (swap with last), so the scheduler never draws a BLOCKED pid.
+struct ReadySet {
+    vector<int> pids;
+    vector<int> slot;
+    int size = 0;
+};
+
+// --clock pending events: (virtual time, pid) in a radix heap. Keys only ever
+// grow past the last popped one, so each entry lives in the bucket of the
+// highest bit where it differs from that key and moves down at most 64 times:
+// push is O(1), pop amortized O(log of the time span), no comparisons.
+struct EventQueue {
+    vector<pair<uint64_t, int>> buckets[65];
+    uint64_t last = 0;  // key of the last pop
+    uint64_t least = 0; // smallest key in buckets 1..64, if least_known
+    bool least_known = false;
+    size_t size = 0;
+
+    static int bucket(uint64_t key, uint64_t last) { return key == last ? 0 : 64 - __builtin_clzll(key ^ last); }
+
+    void clear() {
+        for (auto &b : buckets) b.clear();
+        last = 0;
+        least_known = false;
+        size = 0;
+    }
+
+    void push(uint64_t time, int pid) {
+        int b = bucket(time, last);
+        buckets[b].push_back({time, pid});
+        if (b > 0 && least_known) least = min(least, time);
+        size++;
+    }
+
+    // Key of the earliest event, without popping it: pushes at or past the
+    // last pop stay valid. The lowest non-empty bucket holds the smallest keys.
+    uint64_t top() {
+        if (!buckets[0].empty()) return last;
+        if (!least_known) {
+            int b = 1;
+            while (buckets[b].empty()) b++;
+            least = UINT64_MAX;
+            for (auto &e : buckets[b]) least = min(least, e.first);
+            least_known = true;
+        }
+        return least;
+    }
+
+    // Earliest event; ties leave in reverse push order.
+    pair<uint64_t, int> pop() {
+        if (buckets[0].empty()) {
+            last = top();
+            int b = 1;
+            while (buckets[b].empty()) b++;
+            for (auto &e : buckets[b]) buckets[bucket(e.first, last)].push_back(e);
+            buckets[b].clear();
+            least_known = false;
+        }
+        pair<uint64_t, int> e = buckets[0].back();
+        buckets[0].pop_back();
+        size--;
+        return e;
+    }
+};
+
+// --clock deadlines of timed SemWaits in a hashed timing wheel: slot
+// deadline % TIMER_SLOTS holds a doubly-linked list of the pids due then (links
+// preallocated per pid, like WaitQueue's), so arming and cancelling are O(1) and
+// expiring one is O(1) plus a glance per revolution it waited. An occupancy
+// bitmap lets a scan jump straight to the next non-empty slot.
+const int TIMER_SLOTS = 256;
+
+struct TimerWheel {
+    int head[TIMER_SLOTS];
+    uint64_t occupied[TIMER_SLOTS / 64];
+    vector<int> next, prev; // [pid], -1 = none
+    vector<long> deadline;  // [pid], -1 = not armed
+    long cursor = 0;        // no armed deadline is before this
+    int pending = 0;
+
+    void reset(int processes) {
+        fill(begin(head), end(head), -1);
+        fill(begin(occupied), end(occupied), 0);
+        next.assign(processes, -1);
+        prev.assign(processes, -1);
+        deadline.assign(processes, -1);
+        cursor = 0;
+        pending = 0;
+    }
+
+    bool armed(int pid) const { return deadline[pid] >= 0; }
+
+    void arm(int pid, long when) {
+        int s = (int) (when % TIMER_SLOTS);
+        deadline[pid] = when;
+        prev[pid] = -1;
+        next[pid] = head[s];
+        if (head[s] != -1) prev[head[s]] = pid;
+        head[s] = pid;
+        occupied[s / 64] |= 1ull << (s % 64);
+        pending++;
+    }
+
+    void cancel(int pid) {
+        if (!armed(pid)) return;
+        int s = (int) (deadline[pid] % TIMER_SLOTS);
+        if (prev[pid] != -1) next[prev[pid]] = next[pid];
+        else head[s] = next[pid];
+        if (next[pid] != -1) prev[next[pid]] = prev[pid];
+        if (head[s] == -1) occupied[s / 64] &= ~(1ull << (s % 64));
+        deadline[pid] = -1;
+        pending--;
+    }
+
+    // First non-empty slot at or after s, TIMER_SLOTS if none.
+    int next_slot(int s) const {
+        for (int w = s / 64; w < TIMER_SLOTS / 64; w++) {
+            uint64_t bits = occupied[w] & (w == s / 64 ? ~0ull << (s % 64) : ~0ull);
+            if (bits) return w * 64 + __builtin_ctzll(bits);
+        }
+        return TIMER_SLOTS;
+    }
+
+    // Earliest armed deadline <= until, or -1 if there is none. Either way the
+    // cursor moves up to it, so the next call starts where this one stopped.
+    long earliest(long until) {
+        if (!pending) return -1;
+        while (cursor <= until) {
+            // One revolution: slots from cursor's on, then those before it.
+            int from = (int) (cursor % TIMER_SLOTS);
+            for (int pass = 0; pass < 2; pass++) {
+                int stop = pass == 0 ? TIMER_SLOTS : from;
+                for (int s = next_slot(pass == 0 ? from : 0); s < stop; s = next_slot(s + 1)) {
+                    long t = cursor + (s >= from ? s - from : s + TIMER_SLOTS - from);
+                    if (t > until) break;
+                    for (int pid = head[s]; pid != -1; pid = next[pid]) {
+                        if (deadline[pid] == t) return cursor = t;
+                    }
+                }
+            }
+            cursor += TIMER_SLOTS; // everything left is at least a revolution away
+        }
+        cursor = until;
+        return -1;
+    }
 };
 
-// Shared Data to tracker readers, writers in CS
-int active_readers = 0; // track readers in critical section, case 5 ++ case 6 --
-int active_writers = 0; // track writers in critical section, case 1 ++ case 2 --
-int read_count = 0; // tracks how many enter/exit readers in critical section, if == 1 blocks writers, else == 0 allows writer
+// xoshiro256** scheduler RNG. seed(seed, stream) runs splitmix64 over both
+// values, so every (seed, trial) pair gets its own independent stream and any
+// single trial of a batch can be rebuilt without replaying the others.
+struct Xoshiro256 {
+    uint64_t s[4];
+
+    static uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    void seed(uint64_t seed, uint64_t stream = 0) {
+        uint64_t x = seed;
+        uint64_t mixed = splitmix64(x) ^ stream;
+        x = mixed;
+        for (uint64_t &word : s) word = splitmix64(x);
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, n) by multiply-shift; the bias is below 2^-32 for any n that fits a pid.
+    uint32_t below(uint32_t n) { return (uint32_t) (((next() >> 32) * (uint64_t) n) >> 32); }
+};
+
+// The scheduler only needs seed(seed, stream) and below(n): swap generators here.
+using SimRng = Xoshiro256;
+
+// Wait-for graph of BLOCKED processes, kept as counts per semaphore: a process
+// blocked on t waits for every live process whose remaining program can still
+// signal t. Counts change only when a process blocks, wakes or runs past its
+// last signal of a semaphore, so each update touches a handful of entries.
+struct WaitForGraph {
+    int semaphores = 0;
+    vector<int> can_signal;        // [s]: live processes that may still signal s
+    vector<int> blocked_signalers; // [s]: ... of which BLOCKED
+    vector<int> blocked_on;        // [s * semaphores + t]: ... of which BLOCKED on t
+    uint8_t stuck = SEM_NONE;      // a semaphore nobody who can still run will ever signal
+    const uint32_t *future_signals[2] = {}; // per ProcType, of the programs being run
+};
+
+// Coroutine frames of the processes of one Simulation (--coroutines), destroyed with it.
+struct ProcessCoroutines {
+    vector<coroutine_handle<>> handles; // indexed by pid
+
+    ProcessCoroutines() = default;
+    ProcessCoroutines(const ProcessCoroutines &) = delete;
+    ProcessCoroutines &operator=(const ProcessCoroutines &) = delete;
+    ~ProcessCoroutines() { clear(); }
+
+    void clear() {
+        for (coroutine_handle<> handle : handles) handle.destroy();
+        handles.clear();
+    }
+};
+
+// Log-linear histogram: values below 2^SUB_BITS get a bucket each, every
+// power of two above is split into 2^SUB_BITS buckets, so a reported
+// percentile is within 1/16 of the true value. Fixed size; recording is a
+// count-leading-zeros, two shifts and three adds.
+struct Histogram {
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    array<uint64_t, BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static int bucket(uint64_t v) {
+        if (v < (uint64_t) SUB) return (int) v;
+        int e = 63 - __builtin_clzll(v);
+        return (e - SUB_BITS + 1) * SUB + (int) ((v >> (e - SUB_BITS)) - SUB);
+    }
+
+    // Smallest value that lands in bucket b.
+    static uint64_t lowest(int b) {
+        if (b < SUB) return b;
+        int e = b / SUB + SUB_BITS - 1;
+        return (uint64_t) (b % SUB + SUB) << (e - SUB_BITS);
+    }
+
+    void record(uint64_t v) {
+        counts[bucket(v)]++;
+        total++;
+        sum += v;
+        if (v > max) max = v;
+    }
+
+    void merge(const Histogram &other) {
+        for (int b = 0; b < BUCKETS; b++) counts[b] += other.counts[b];
+        total += other.total;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double q) const {
+        uint64_t rank = (uint64_t) (q * total), seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen > rank) return std::min(lowest(b), max);
+        }
+        return max;
+    }
+};
+
+// Starvation metrics, in scheduler steps. Process metrics get one sample per
+// finished process; semaphore metrics one per BLOCK (wait) or per hold: from a
+// process's acquire (or wake-up) to its own SemSignal. A release by a process
+// that did not acquire, like the last reader freeing the wrt the first one
+// took, ends no hold.
+enum ProcessMetric : uint8_t { PM_BLOCKED_STEPS, PM_BLOCKS, PM_TIME_TO_CS, PM_FINISHED_AT, PM_COUNT };
+const char *const PROCESS_METRIC_NAMES[] = {"time BLOCKED", "blocks", "first wait to CS", "finished at"};
+
+struct Metrics {
+    Histogram process[2][PM_COUNT]; // [ProcType][ProcessMetric]
+    vector<Histogram> sem_wait;     // [SemId]
+    vector<Histogram> sem_hold;     // [SemId]
+    vector<Histogram> sem_timeout;  // [SemId]: time waited by timed waits that gave up
+
+    explicit Metrics(int semaphores) : sem_wait(semaphores), sem_hold(semaphores), sem_timeout(semaphores) {}
+
+    void merge(const Metrics &other) {
+        for (int type = 0; type < 2; type++) {
+            for (int m = 0; m < PM_COUNT; m++) process[type][m].merge(other.process[type][m]);
+        }
+        for (size_t s = 0; s < sem_wait.size(); s++) {
+            sem_wait[s].merge(other.sem_wait[s]);
+            sem_hold[s].merge(other.sem_hold[s]);
+            sem_timeout[s].merge(other.sem_timeout[s]);
+        }
+    }
+};
+
+// Per-trial bookkeeping behind Metrics; sized only when metrics are on.
+struct WaitStats {
+    vector<long> first_wait;    // [pid]: step of its first SemWait, -1 before
+    vector<long> blocked_since; // [pid]: step it last BLOCKED at
+    vector<long> blocked_steps; // [pid]
+    vector<int> blocks;         // [pid]
+    vector<long> held_since;    // [pid * semaphores + SemId]: step pid acquired it, -1 while not held
+};
+
+// Scheduler picks of a run: pid deltas, zigzag-encoded as LEB128 varints, so
+// a pick between nearby pids takes one byte.
+struct ScheduleLog {
+    vector<uint8_t> bytes;
+    long picks = 0;
+    int last = 0; // previous pid
+};
+
+// One independent simulation: everything a trial reads or writes lives here,
+// so parallel trials never share state.
+struct Simulation {
+    ProcessTable processes; // storage of processes, indexed by pid
+    ReadySet ready_set;
+
+    // Simulated variables to mimic Semaphores
+    SimSemaphore read_count_lock = {1, {}, "read_count_lock", SEM_READ_COUNT_LOCK};   // protect the read_count variable.
+    SimSemaphore wrt = {1, {}, "wrt", SEM_WRT};                                       // "to block access to critical area"
+    SimSemaphore reader_limiter = {2, {}, "reader_limiter", SEM_READER_LIMITER};      // control how many are in critical section.
+
+    // Shared Data to tracker readers, writers in CS
+    int active_readers = 0; // track readers in critical section, case 5 ++ case 6 --
+    int active_writers = 0; // track writers in critical section, case 1 ++ case 2 --
+    int read_count = 0; // tracks how many enter/exit readers in critical section, if == 1 blocks writers, else == 0 allows writer
+
+    // Semaphores and shared variables a protocol file declares beyond the built-in ones
+    vector<SimSemaphore> extra_semaphores;
+    vector<int> extra_shared;
+    const Protocol *protocol = nullptr; // programs to run, nullptr = built-in tables
+    bool coroutines = false;            // run the built-in programs as coroutines instead
+    ProcessCoroutines bodies;
+    const InvariantSet *invariants = nullptr;
+    uint64_t dirty = 0;    // state variables changed since the last invariant check
+    uint64_t violated = 0; // invariants currently broken, so each violation panics once
+    WaitForGraph wait_for;
+    bool detect_deadlock = true; // off in the explorer and DPOR, which check whole states
+
+    int reader_limit = 2;
+    Trace *trace = nullptr; // event sink, or nullptr to record nothing (batch)
+    Metrics *metrics = nullptr; // histogram sink, or nullptr to record nothing
+    ScheduleLog *schedule = nullptr; // records every scheduler pick, or nullptr
+    EventQueue *events = nullptr;    // --clock: when each READY process runs next, or nullptr
+    TimerWheel *timers = nullptr;    // --clock: deadlines of timed waits, or nullptr
+    long wait_timeout = 100;         // what "wait_timed S timeout ..." means
+    const array<Duration, 16> *durations = nullptr; // --clock: per Op
+    long now = 0;                    // --clock: virtual time
+    WaitStats wait_stats;
+    bool run_to_block = false;
+    SimRng rng;
+    SimRng wake_rng; // WAKE_RANDOM picks, see seed_trial()
+
+    // Per-trial statistics
+    long pause_at = LONG_MAX; // run_simulation returns before the first pick at or past this step
+    long steps = 0;
+    long dispatches = 0; // scheduler picks; equals steps unless run_to_block
+    long blocks = 0;
+    long timeouts = 0; // timed waits that gave up
+    int panics = 0;
+};
+
+// What one trial produced, reduced across the batch.
+struct TrialResult {
+    long steps;
+    long dispatches;
+    long blocks;
+    int panics;
+    bool deadlocked;
+    long time = 0; // --clock: virtual time at the end
+    long timeouts = 0;
+};
+
+Config config;
+
+
+///// ---  EVENT TRACE FUNCTIONS START --- /////
+
+const char TRACE_MAGIC[4] = {'P', '3', 'T', 'R'};
+const uint32_t TRACE_VERSION = 5; // v2: seed in header, v3: PANIC names its invariant, v4: WAITS_FOR, v5: TIMED_OUT
+const size_t TRACE_BINARY_BATCH = 1 << 16; // records per fwrite
+const size_t TRACE_TEXT_BATCH = 1 << 20;   // bytes per fwrite
+
+// Render one record as the lines the simulator used to print.
+void format_event(const TraceRecord &r, string &out, const vector<string> *sem_names = nullptr,
+                  const InvariantSet *invariants = nullptr) {
+    string pid = to_string(r.pid);
+    string sem = sem_names && r.sem < sem_names->size() ? (*sem_names)[r.sem]
+               : r.sem < SEM_BUILTIN_COUNT ? SEM_NAMES[r.sem] : "semaphore " + to_string(r.sem);
+    switch (r.kind) {
+        case EV_BLOCKED:
+            out += "Process " + pid + " tried to access " + sem + " but was BLOCKED.\n";
+            break;
+        case EV_UNBLOCKED:
+            out += "Process " + pid + " UNBLOCKED from " + sem + "\n";
+            break;
+        case EV_WRITER_ENTER:
+            out += "Writer " + pid + " enters. Other Readers: " + to_string(r.value)
+                 + ", Other Writers: " + to_string(r.extra - 1) + "\n";
+            out += "Writer " + pid + " is WRITING.\n";
+            break;
+        case EV_READER_ENTER:
+            out += "Reader " + pid + " enters. Other Readers: " + to_string(r.value - 1)
+                 + ", Other Writers: " + to_string(r.extra) + "\n";
+            out += "Reader " + pid + " is READING.\n";
+            break;
+        case EV_READER_BUSY:
+            out += "Reader " + pid + " is READING (Busy work)...\n";
+            break;
+        case EV_WRITER_FINISHED:
+            out += "Writer " + pid + " finished.\n";
+            break;
+        case EV_READER_FINISHED:
+            out += "Reader " + pid + " finished.\n";
+            break;
+        case EV_PANIC:
+            out += "\n***************************************************\n";
+            out += "PANIC: Synchronization Rules Violated!\n";
+            out += "Invariant: " + (invariants && r.detail < invariants->invariants.size()
+                                    ? invariants->invariants[r.detail].name : to_string(r.detail)) + "\n";
+            out += "Active Writers: " + to_string(r.extra) + "\n";
+            out += "Active Readers: " + to_string(r.value) + "\n";
+            out += "***************************************************\n\n";
+            break;
+        case EV_DEADLOCK:
+            if (r.extra == 0) out += "\nDEADLOCK: all " + to_string(r.value) + " remaining processes are BLOCKED.\n";
+            else out += "\nDEADLOCK: these BLOCKED processes can never be woken (" + to_string(r.value) + " still live):\n";
+            break;
+        case EV_WAITS_FOR:
+            if (r.value >= 0) out += "  Process " + pid + " waits on " + sem + " for Process " + to_string(r.value) + "\n";
+            else out += "  Process " + pid + " waits on " + sem + ", which no live process can signal\n";
+            break;
+        case EV_TIMED_OUT:
+            out += "Process " + pid + " TIMED OUT waiting on " + sem + "\n";
+            break;
+    }
+}
+
+void trace_flush(Trace &trace) {
+    if (trace.mode == TRACE_BINARY && !trace.records.empty()) {
+        fwrite(trace.records.data(), sizeof(TraceRecord), trace.records.size(), trace.out);
+        trace.records.clear();
+    } else if (trace.mode == TRACE_TEXT && !trace.text.empty()) {
+        fwrite(trace.text.data(), 1, trace.text.size(), trace.out);
+        trace.text.clear();
+    }
+    fflush(trace.out);
+}
+
+// Attach trace to out; binary traces start with a small header that records
+// the seed the traced run was scheduled with.
+void trace_open(Trace &trace, TraceMode mode, FILE *out, uint64_t seed = 0) {
+    trace.mode = mode;
+    trace.out = out;
+    trace.events = 0;
+    if (mode == TRACE_BINARY) {
+        uint32_t record_size = sizeof(TraceRecord);
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), out);
+        fwrite(&TRACE_VERSION, sizeof(TRACE_VERSION), 1, out);
+        fwrite(&record_size, sizeof(record_size), 1, out);
+        fwrite(&seed, sizeof(seed), 1, out);
+        trace.records.reserve(TRACE_BINARY_BATCH);
+    } else if (mode == TRACE_TEXT) {
+        trace.text.reserve(TRACE_TEXT_BATCH + 256);
+    }
+}
+
+void trace_record(Trace &trace, const TraceRecord &r) {
+    trace.events++;
+    if (trace.mode == TRACE_BINARY) {
+        trace.records.push_back(r);
+        if (trace.records.size() >= TRACE_BINARY_BATCH) trace_flush(trace);
+    } else if (trace.mode == TRACE_TEXT) {
+        format_event(r, trace.text, trace.sem_names, trace.invariants);
+        if (trace.text.size() >= TRACE_TEXT_BATCH) trace_flush(trace);
+    }
+}
+
+// Record an event of the current step if sim is being traced.
+inline void trace_event(Simulation &sim, EventKind kind, int pid, uint8_t sem = SEM_NONE, int value = 0, int extra = 0,
+                        uint16_t detail = 0) {
+    if (!sim.trace) return;
+    trace_record(*sim.trace, {(uint64_t) sim.steps, pid, kind, sem, detail, value, extra});
+}
+
+// Decode a binary trace file back into today's text on stdout; sem_names and
+// invariants resolve the names declared by the protocol file the run used.
+bool decode_trace(const char *path, const vector<string> *sem_names, const InvariantSet *invariants) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        cout << "Cannot open trace " << path << endl;
+        return false;
+    }
+    char magic[4];
+    uint32_t version = 0, record_size = 0;
+    uint64_t seed = 0;
+    bool ok = fread(magic, 1, 4, in) == 4 && memcmp(magic, TRACE_MAGIC, 4) == 0
+              && fread(&version, sizeof(version), 1, in) == 1 && version == TRACE_VERSION
+              && fread(&record_size, sizeof(record_size), 1, in) == 1 && record_size == sizeof(TraceRecord)
+              && fread(&seed, sizeof(seed), 1, in) == 1;
+    if (!ok) {
+        cout << "Not a version " << TRACE_VERSION << " trace: " << path << endl;
+        fclose(in);
+        return false;
+    }
+    cerr << "Seed: " << seed << endl; // keep stdout identical to --trace text
+
+    Trace text;
+    trace_open(text, TRACE_TEXT, stdout);
+    text.sem_names = sem_names;
+    text.invariants = invariants;
+    vector<TraceRecord> batch(TRACE_BINARY_BATCH);
+    size_t n;
+    while ((n = fread(batch.data(), sizeof(TraceRecord), batch.size(), in)) > 0) {
+        for (size_t i = 0; i < n; i++) trace_record(text, batch[i]);
+    }
+    trace_flush(text);
+    fclose(in);
+    return true;
+}
+
+///// ---  EVENT TRACE FUNCTIONS END ----- /////
+
+
+///// ---  READY SET FUNCTIONS START --- /////
+
+void ready_add(ReadySet &ready_set, int pid) {
+    if (ready_set.slot[pid] != -1) return;
+    ready_set.slot[pid] = ready_set.size;
+    ready_set.pids[ready_set.size++] = pid;
+}
+
+void ready_remove(ReadySet &ready_set, int pid) {
+    int s = ready_set.slot[pid];
+    if (s == -1) return;
+    int last = ready_set.pids[--ready_set.size];
+    ready_set.pids[s] = last;
+    ready_set.slot[last] = s;
+    ready_set.slot[pid] = -1;
+}
+
+// Every status change goes through here so the READY set never goes stale.
+void set_status(Simulation &sim, int pid, Status status) {
+    sim.processes.status[pid] = status;
+    if (status == READY) ready_add(sim.ready_set, pid);
+    else ready_remove(sim.ready_set, pid);
+}
+
+///// ---  READY SET FUNCTIONS END ----- /////
+
+
+///// ---  METRICS FUNCTIONS START --- /////
+
+// Metrics are in scheduler steps, or in virtual time under --clock.
+inline long metrics_now(const Simulation &sim) { return sim.events ? sim.now : sim.steps; }
+
+void metrics_reset(Simulation &sim) {
+    if (!sim.metrics) return;
+    int total = sim.processes.size();
+    WaitStats &stats = sim.wait_stats;
+    stats.first_wait.assign(total, -1);
+    stats.blocked_since.assign(total, 0);
+    stats.blocked_steps.assign(total, 0);
+    stats.blocks.assign(total, 0);
+    stats.held_since.assign(total * sim.metrics->sem_hold.size(), -1);
+}
+
+// After sem.value-- for pid.
+inline void metrics_wait(Simulation &sim, const SimSemaphore &sem, int pid) {
+    if (!sim.metrics) return;
+    WaitStats &stats = sim.wait_stats;
+    if (stats.first_wait[pid] < 0) stats.first_wait[pid] = metrics_now(sim);
+    if (sem.value >= 0) stats.held_since[(size_t) pid * sim.metrics->sem_hold.size() + sem.id] = metrics_now(sim);
+    if (sem.value < 0) {
+        stats.blocked_since[pid] = metrics_now(sim);
+        stats.blocks[pid]++;
+    }
+}
+
+// After pid's sem.value++; woken_pid is -1 if nobody was waiting.
+inline void metrics_signal(Simulation &sim, const SimSemaphore &sem, int pid, int woken_pid) {
+    if (!sim.metrics) return;
+    WaitStats &stats = sim.wait_stats;
+    size_t semaphores = sim.metrics->sem_hold.size();
+    long &held_since = stats.held_since[(size_t) pid * semaphores + sem.id];
+    if (held_since >= 0) {
+        sim.metrics->sem_hold[sem.id].record(metrics_now(sim) - held_since);
+        held_since = -1;
+    }
+    if (woken_pid >= 0) {
+        long waited = metrics_now(sim) - stats.blocked_since[woken_pid];
+        stats.blocked_steps[woken_pid] += waited;
+        sim.metrics->sem_wait[sem.id].record(waited);
+        stats.held_since[(size_t) woken_pid * semaphores + sem.id] = metrics_now(sim);
+    }
+}
+
+// pid gave up waiting on sem (and its sem.value++ already undid its wait).
+inline void metrics_timeout(Simulation &sim, const SimSemaphore &sem, int pid) {
+    if (!sim.metrics) return;
+    long waited = metrics_now(sim) - sim.wait_stats.blocked_since[pid];
+    sim.wait_stats.blocked_steps[pid] += waited;
+    sim.metrics->sem_timeout[sem.id].record(waited);
+}
+
+inline void metrics_cs_enter(Simulation &sim, int pid) {
+    if (!sim.metrics) return;
+    long first = sim.wait_stats.first_wait[pid];
+    sim.metrics->process[sim.processes.type[pid]][PM_TIME_TO_CS].record(first < 0 ? 0 : metrics_now(sim) - first);
+}
 
+inline void metrics_finish(Simulation &sim, int pid) {
+    if (!sim.metrics) return;
+    Histogram *process = sim.metrics->process[sim.processes.type[pid]];
+    process[PM_BLOCKED_STEPS].record(sim.wait_stats.blocked_steps[pid]);
+    process[PM_BLOCKS].record(sim.wait_stats.blocks[pid]);
+    process[PM_FINISHED_AT].record(metrics_now(sim));
+}
 
-Process processes[6]; // storage of processes IDs
+void print_metrics(const Metrics &metrics, const vector<string> &sem_names, const char *unit = "scheduler steps") {
+    cout << "Wait metrics, in " << unit << " (percentiles within 1/16):" << endl;
+    cout << "  " << left << setw(36) << "" << right << setw(10) << "count" << setw(10) << "mean"
+         << setw(8) << "p50" << setw(8) << "p90" << setw(8) << "p99" << setw(8) << "max" << endl;
+    auto row = [](const string &name, const Histogram &h) {
+        if (h.total == 0) return;
+        cout << "  " << left << setw(36) << name << right << setw(10) << h.total << setw(10) << fixed
+             << setprecision(2) << (double) h.sum / h.total << defaultfloat << setprecision(6)
+             << setw(8) << h.percentile(0.50) << setw(8) << h.percentile(0.90) << setw(8) << h.percentile(0.99)
+             << setw(8) << h.max << endl;
+    };
+    for (int type : {READER, WRITER}) {
+        for (int m = 0; m < PM_COUNT; m++) {
+            row(string(type == READER ? "reader " : "writer ") + PROCESS_METRIC_NAMES[m], metrics.process[type][m]);
+        }
+    }
+    for (size_t s = 0; s < metrics.sem_wait.size(); s++) {
+        row("wait on " + sem_names[s], metrics.sem_wait[s]);
+        row("hold " + sem_names[s], metrics.sem_hold[s]);
+        row("timed out on " + sem_names[s], metrics.sem_timeout[s]);
+    }
+}
 
-// Simulated variables to mimic Semaphores
-SimSemaphore read_count_lock = {1, {}, "read_count_lock"};   // protect the read_count variable.
-SimSemaphore wrt = {1, {}, "wrt"};                           // "to block access to critical area"
-SimSemaphore reader_limiter = {2, {}, "reader_limiter"};      // control how many are in critical section.
+///// ---  METRICS FUNCTIONS END ----- /////
 
 
 ///// ---  SimSemaphore FUNCTIONS START --- /////
 
-bool SemWait(SimSemaphore &sem, int pid) {
+// Wait-for graph updates, see DEADLOCK DETECTOR.
+void wait_for_blocked(Simulation &sim, int pid, int sem);
+void wait_for_woken(Simulation &sim, int pid, int sem);
+
+void wait_push_back(ProcessTable &processes, WaitQueue &queue, int pid) {
+    processes.wait_next[pid] = -1;
+    processes.wait_prev[pid] = queue.tail;
+    if (queue.tail != -1) processes.wait_next[queue.tail] = pid;
+    else queue.head = pid;
+    queue.tail = pid;
+    queue.size++;
+}
+
+int wait_pop_front(ProcessTable &processes, WaitQueue &queue) {
+    int pid = queue.head;
+    queue.head = processes.wait_next[pid];
+    if (queue.head == -1) queue.tail = -1;
+    else processes.wait_prev[queue.head] = -1;
+    if (queue.last_writer == pid) queue.last_writer = -1;
+    processes.wait_next[pid] = -1;
+    queue.size--;
+    return pid;
+}
+
+// Take pid out of the middle of queue (a timed wait giving up).
+void wait_unlink(ProcessTable &processes, WaitQueue &queue, int pid) {
+    int prev = processes.wait_prev[pid], next = processes.wait_next[pid];
+    if (prev != -1) processes.wait_next[prev] = next;
+    else queue.head = next;
+    if (next != -1) processes.wait_prev[next] = prev;
+    else queue.tail = prev;
+    if (queue.last_writer == pid) queue.last_writer = prev; // writers are contiguous from the head
+    processes.wait_next[pid] = -1;
+    processes.wait_prev[pid] = -1;
+    queue.size--;
+}
+
+// Queue pid on sem. Writers-first slots a writer in behind the writers already
+// queued, so SemSignal still takes from the head; only random walks the queue.
+void wait_enqueue(Simulation &sim, SimSemaphore &sem, int pid) {
+    ProcessTable &processes = sim.processes;
+    WaitQueue &queue = sem.wait_queue;
+    if (sem.policy != WAKE_WRITERS_FIRST || processes.type[pid] != WRITER) {
+        wait_push_back(processes, queue, pid);
+        return;
+    }
+    int prev = queue.last_writer, next = prev == -1 ? queue.head : processes.wait_next[prev];
+    processes.wait_prev[pid] = prev;
+    processes.wait_next[pid] = next;
+    if (prev != -1) processes.wait_next[prev] = pid;
+    else queue.head = pid;
+    if (next != -1) processes.wait_prev[next] = pid;
+    else queue.tail = pid;
+    queue.last_writer = pid;
+    queue.size++;
+}
+
+// Dequeue the pid SemSignal wakes under sem's policy.
+int wait_take(Simulation &sim, SimSemaphore &sem) {
+    WaitQueue &queue = sem.wait_queue;
+    int pid = queue.head;
+    switch (sem.policy) {
+        case WAKE_LIFO:
+            pid = queue.tail;
+            break;
+        case WAKE_RANDOM: { // walk in from the nearer end
+            int k = (int) sim.wake_rng.below(queue.size);
+            if (k < queue.size / 2) {
+                for (; k > 0; k--) pid = sim.processes.wait_next[pid];
+            } else {
+                pid = queue.tail;
+                for (k = queue.size - 1 - k; k > 0; k--) pid = sim.processes.wait_prev[pid];
+            }
+            break;
+        }
+        default: // FIFO, writers first
+            return wait_pop_front(sim.processes, queue);
+    }
+    wait_unlink(sim.processes, queue, pid);
+    return pid;
+}
+
+// timeout >= 0 (--clock only): if pid blocks, it gives up at sim.now + timeout
+// unless signalled first, see expire_timers().
+bool SemWait(Simulation &sim, SimSemaphore &sem, int pid, long timeout = -1) {
     sem.value--;
+    sim.dirty |= var_bit(sem.id);
+    metrics_wait(sim, sem, pid);
     if (sem.value < 0) {
         //  When resource busy == true -> Add to queue & block
-        sem.wait_queue.push_back(pid);
-        processes[pid].status = BLOCKED;
+        wait_enqueue(sim, sem, pid);
+        set_status(sim, pid, BLOCKED);
+        sim.blocks++;
+        if (timeout >= 0) sim.timers->arm(pid, sim.now + timeout);
+        wait_for_blocked(sim, pid, sem.id);
 
         //  makes  collision visible
-        cout << "Process " << pid << " tried to access " << sem.name << " but was BLOCKED." << endl;
+        trace_event(sim, EV_BLOCKED, pid, sem.id);
 
         return false;
     }
@@ -58,197 +967,3787 @@ bool SemWait(SimSemaphore &sem, int pid) {
 
 
 // --- SIGNAL OPERATION ---
-void SemSignal(SimSemaphore &sem) {
+void SemSignal(Simulation &sim, SimSemaphore &sem, int pid) {
     sem.value++;
+    sim.dirty |= var_bit(sem.id);
 
     if (sem.value <= 0) {
         // Someone is waiting: Wake them up
         if (!sem.wait_queue.empty()) {
-            int wakeup_pid = sem.wait_queue.front();
-            sem.wait_queue.pop_front();
+            int wakeup_pid = wait_take(sim, sem);
 
-            processes[wakeup_pid].status = READY;
+            set_status(sim, wakeup_pid, READY);
 
             // ***  move thread forward ***
-            processes[wakeup_pid].program_counter++;
-            cout << "Process " << wakeup_pid << " UNBLOCKED from " << sem.name << endl;
+            sim.processes.program_counter[wakeup_pid]++;
+            if (sim.events) sim.events->push(sim.now, wakeup_pid);
+            wait_for_woken(sim, wakeup_pid, sem.id);
+            if (sim.timers) sim.timers->cancel(wakeup_pid);
+            trace_event(sim, EV_UNBLOCKED, wakeup_pid, sem.id);
+            metrics_signal(sim, sem, pid, wakeup_pid);
+            return;
         }
     }
+    metrics_signal(sim, sem, pid, -1);
 }
 
 
 ///// ---  SimSemaphore FUNCTIONS END ----- /////
 
-void check_panic() { // Checks if the Critical Section rules are being violated.
-    //  No writer and reader together.|| //  No two writers together. || //  Max 2 readers.
-    if (active_writers > 1 || (active_writers > 0 && active_readers > 0) || active_readers > 2) {
-        cout << "\n***************************************************" << endl;
-        cout << "PANIC: Synchronization Rules Violated!" << endl;
-        cout << "Active Writers: " << active_writers << endl;
-        cout << "Active Readers: " << active_readers << endl;
-        cout << "***************************************************\n" << endl;
+
+///// ---  INVARIANT FUNCTIONS START --- /////
+
+// Register inv in set; false if the set is full.
+bool add_invariant(InvariantSet &set, const Invariant &inv) {
+    if ((int) set.invariants.size() >= MAX_INVARIANTS) return false;
+    uint64_t bit = 1ull << set.invariants.size();
+    set.invariants.push_back(inv);
+    set.watched |= inv.depends;
+    for (uint64_t vars = inv.depends; vars; vars &= vars - 1) {
+        int var = __builtin_ctzll(vars);
+        set.affected[var] |= bit;
+        set.related[var] |= inv.depends;
     }
+    return true;
 }
 
-////// --- WORKER FUNCTIONS START--- /////
-
-// Function for WRITERS
-void run_writer(int pid) {
-    Process &current_process = processes[pid];
-    switch (current_process.program_counter) {
-        case 0: // Request Entry
-            if (SemWait(wrt, pid)) current_process.program_counter++;
-            break;
-        case 1: // Instruction: CRITICAL SECTION (Writing)
-            active_writers++;
+// The Critical Section rules.
+bool one_writer(const Simulation &sim, const Invariant &) { return sim.active_writers <= 1; }
+bool no_reader_with_writer(const Simulation &sim, const Invariant &) { return sim.active_writers == 0 || sim.active_readers == 0; }
+bool readers_within_limit(const Simulation &sim, const Invariant &) { return sim.active_readers <= sim.reader_limit; }
 
-            // REQUIREMENT: Report other readers/writers
-            cout << "Writer " << pid << " enters. "
-                 << "Other Readers: " << active_readers
-                 << ", Other Writers: " << (active_writers - 1) << endl;
-            cout << "Writer " << pid << " is WRITING." << endl;
+InvariantSet make_builtin_invariants() {
+    InvariantSet set;
+    add_invariant(set, {"one_writer", var_bit(VAR_ACTIVE_WRITERS), one_writer});
+    add_invariant(set, {"no_reader_with_writer", var_bit(VAR_ACTIVE_READERS) | var_bit(VAR_ACTIVE_WRITERS), no_reader_with_writer});
+    add_invariant(set, {"readers_within_limit", var_bit(VAR_ACTIVE_READERS), readers_within_limit});
+    return set;
+}
 
-            // --- PANIC CHECK ---
-            check_panic();
+const InvariantSet BUILTIN_INVARIANTS = make_builtin_invariants();
 
-            current_process.program_counter++;
-            break;
-        case 2: // Exit Critical Section
-            active_writers--;
-            SemSignal(wrt);
-            current_process.program_counter++;
-            break;
-        case 3: // Finish
-            cout << "Writer " << pid << " finished." << endl;
-            current_process.status = FINISHED;
-            break;
+// Re-check only the invariants that depend on a variable changed since the last
+// call. An invariant panics when it becomes violated, not again while it stays so.
+void check_invariants(Simulation &sim) {
+    const InvariantSet &set = *sim.invariants;
+    uint64_t changed = sim.dirty & set.watched;
+    sim.dirty = 0;
+    uint64_t affected = 0;
+    for (; changed; changed &= changed - 1) affected |= set.affected[__builtin_ctzll(changed)];
+    for (; affected; affected &= affected - 1) {
+        int i = __builtin_ctzll(affected);
+        const Invariant &inv = set.invariants[i];
+        uint64_t bit = 1ull << i;
+        if (inv.holds(sim, inv)) {
+            sim.violated &= ~bit;
+        } else if (!(sim.violated & bit)) {
+            sim.violated |= bit;
+            sim.panics++;
+            trace_event(sim, EV_PANIC, -1, SEM_NONE, sim.active_readers, sim.active_writers, (uint16_t) i);
+        }
     }
 }
 
-// Function for READERS
-void run_reader(int pid) {
-    Process &current_process = processes[pid];
-    switch (current_process.program_counter) {
+// Evaluate every invariant from scratch, e.g. on a state the explorer just decoded.
+bool invariants_hold(const Simulation &sim) {
+    for (const Invariant &inv : sim.invariants->invariants) {
+        if (!inv.holds(sim, inv)) return false;
+    }
+    return true;
+}
 
-        case 0: // Check Reader Limit (Max 2) [cite: 6]
-            if (SemWait(reader_limiter, pid)) current_process.program_counter++;
-            break;
+///// ---  INVARIANT FUNCTIONS END ----- /////
 
-        case 1: // Lock read_count
-            if (SemWait(read_count_lock, pid)) current_process.program_counter++;
-            break;
+////// --- WORKER FUNCTIONS START--- /////
 
-        case 2: // Increment read_count
-            read_count++;
-            current_process.program_counter++;
-            break;
+// Process programs are constexpr instruction tables; program_counter indexes them.
+enum Op : uint8_t {
+    OP_WAIT, OP_SIGNAL,         // SemWait / SemSignal on sem
+    OP_WAIT_IF, OP_SIGNAL_IF,   // same, but only if shared var == when (otherwise a no-op)
+    OP_INC_SHARED, OP_DEC_SHARED,
+    OP_ENTER_CS, OP_EXIT_CS,    // CS entry reports others; exit may also signal sem
+    OP_BUSY, OP_FINISH,
+    OP_WAIT_TIMED,              // SemWait giving up after timeout, then jumping to target (--clock)
+    OP_COUNT
+};
+// Protocol file spelling, also used by --duration.
+const char *const OP_NAMES[] = {"wait", "signal", "wait_if", "signal_if", "inc", "dec", "enter_cs", "exit_cs", "busy", "finish",
+                                "wait_timed"};
+static_assert(size(OP_NAMES) == OP_COUNT && OP_COUNT <= size(Config{}.durations));
 
-        case 3: // First reader locks writer
-            if (read_count == 1) {
-                // If we get the lock, we move manually.
-                // If we BLOCK, SemSignal will move us when we wake ucurrent_process.
-                if (SemWait(wrt, pid)) {  current_process.program_counter++;}
-            } else { current_process.program_counter++; }
-            break;
+enum SharedVar : uint8_t { SHARED_READ_COUNT };
 
-        case 4: // Release read_count lock
-            SemSignal(read_count_lock);
-            current_process.program_counter++;
-            break;
+struct Instruction {
+    Op op;
+    uint8_t sem = SEM_NONE; // SemId operand
+    uint8_t var = 0;        // SharedVar operand, or ProcType for CS ops
+    int8_t when = 0;        // OP_WAIT_IF / OP_SIGNAL_IF condition
+    uint16_t target = 0;    // OP_WAIT_TIMED: program counter to resume at after a timeout
+    int32_t timeout = 0;    // OP_WAIT_TIMED: virtual time, or TIMEOUT_OPTION
+};
 
-        case 5: // Instruction: CRITICAL SECTION (Reading)
-            active_readers++;
+const int32_t TIMEOUT_OPTION = -1; // Instruction::timeout placeholder for --timeout
 
-            // Report other readers/writers
-            cout << "Reader " << pid << " enters. "
-                 << "Other Readers: " << (active_readers - 1)
-                 << ", Other Writers: " << active_writers << endl;
-            cout << "Reader " << pid << " is READING." << endl;
+constexpr Instruction Wait(SemId sem) { return {OP_WAIT, sem}; }
+constexpr Instruction Signal(SemId sem) { return {OP_SIGNAL, sem}; }
+constexpr Instruction WaitIf(SemId sem, SharedVar var, int when) { return {OP_WAIT_IF, sem, var, (int8_t) when}; }
+constexpr Instruction SignalIf(SemId sem, SharedVar var, int when) { return {OP_SIGNAL_IF, sem, var, (int8_t) when}; }
+constexpr Instruction IncShared(SharedVar var) { return {OP_INC_SHARED, SEM_NONE, var}; }
+constexpr Instruction DecShared(SharedVar var) { return {OP_DEC_SHARED, SEM_NONE, var}; }
+constexpr Instruction EnterCS(ProcType role) { return {OP_ENTER_CS, SEM_NONE, role}; }
+constexpr Instruction ExitCS(ProcType role, SemId then_signal = SEM_NONE) { return {OP_EXIT_CS, then_signal, role}; }
+constexpr Instruction Busy() { return {OP_BUSY}; }
+constexpr Instruction Finish() { return {OP_FINISH}; }
 
-            check_panic(); // --- PANIC CHECK ---
-            current_process.program_counter++;
-            break;
+// Program for WRITERS
+constexpr Instruction WRITER_PROGRAM[] = {
+    Wait(SEM_WRT),              // 0: Request Entry
+    EnterCS(WRITER),            // 1: CRITICAL SECTION (Writing), report others
+    ExitCS(WRITER, SEM_WRT),    // 2: Exit Critical Section
+    Finish(),                   // 3: Finish
+};
 
-        case 6: // scheduler to picks someone else  while  reader is still holding the lock!
-             cout << "Reader " << pid << " is READING (Busy work)..." << endl;
+// Program for READERS
+constexpr Instruction READER_PROGRAM[] = {
+    Wait(SEM_READER_LIMITER),                   // 0: Check Reader Limit (Max reader_limit) [cite: 6]
+    Wait(SEM_READ_COUNT_LOCK),                  // 1: Lock read_count
+    IncShared(SHARED_READ_COUNT),               // 2: Increment read_count
+    WaitIf(SEM_WRT, SHARED_READ_COUNT, 1),      // 3: First reader locks writer
+    Signal(SEM_READ_COUNT_LOCK),                // 4: Release read_count lock
+    EnterCS(READER),                            // 5: CRITICAL SECTION (Reading), report others
+    Busy(),                                     // 6: scheduler to picks someone else while reader is still holding the lock!
+    ExitCS(READER),                             // 7: Exit CS
+    Wait(SEM_READ_COUNT_LOCK),                  // 8: Lock read_count for exit
+    DecShared(SHARED_READ_COUNT),               // 9: Decrement read_count
+    SignalIf(SEM_WRT, SHARED_READ_COUNT, 0),    // 10: Last reader releases writer
+    Signal(SEM_READ_COUNT_LOCK),                // 11: Release read_count lock
+    Signal(SEM_READER_LIMITER),                 // 12: Release slot for other readers
+    Finish(),                                   // 13: Finish
+};
 
-             current_process.program_counter++;
-             break;
+// Indexed by ProcType.
+const Instruction *const PROGRAMS[] = {READER_PROGRAM, WRITER_PROGRAM};
 
-        case 7: // Exit CS
-            active_readers--;
-            current_process.program_counter++;
-            break;
+// [pc]: semaphores the program may still signal from pc on (conditional signals
+// included). A timed wait also leads to its target, which may jump back, so
+// sweeps repeat until nothing changes; straight-line code settles in the first.
+vector<uint32_t> future_signals(const Instruction *code, size_t size) {
+    vector<uint32_t> masks(size + 1, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t pc = size; pc-- > 0;) {
+            const Instruction &ins = code[pc];
+            bool signals = ins.op == OP_SIGNAL || ins.op == OP_SIGNAL_IF || (ins.op == OP_EXIT_CS && ins.sem != SEM_NONE);
+            uint32_t mask = masks[pc + 1] | (signals ? 1u << ins.sem : 0) | (ins.op == OP_WAIT_TIMED ? masks[ins.target] : 0);
+            changed |= mask != masks[pc];
+            masks[pc] = mask;
+        }
+    }
+    masks.pop_back();
+    return masks;
+}
 
-        case 8: // Lock read_count for exit
-            if (SemWait(read_count_lock, pid)) current_process.program_counter++;
-            break;
+// Indexed by ProcType.
+const vector<uint32_t> BUILTIN_FUTURE_SIGNALS[] = {
+    future_signals(READER_PROGRAM, size(READER_PROGRAM)), future_signals(WRITER_PROGRAM, size(WRITER_PROGRAM))
+};
 
-        case 9: // Decrement read_count
-            read_count--;
-            current_process.program_counter++;
-            break;
 
-        case 10: // Last reader releases writer
-            if (read_count == 0) SemSignal(wrt);
-            current_process.program_counter++;
-            break;
+inline SimSemaphore &semaphore(Simulation &sim, uint8_t id) {
+    switch (id) {
+        case SEM_READ_COUNT_LOCK: return sim.read_count_lock;
+        case SEM_WRT: return sim.wrt;
+        case SEM_READER_LIMITER: return sim.reader_limiter;
+        default: return sim.extra_semaphores[id - SEM_BUILTIN_COUNT];
+    }
+}
 
-        case 11: // Release read_count lock
-            SemSignal(read_count_lock);
-            current_process.program_counter++;
-            break;
+inline const SimSemaphore &semaphore(const Simulation &sim, uint8_t id) {
+    return semaphore(const_cast<Simulation &>(sim), id);
+}
 
-        case 12: // Release slot for other readers
-            SemSignal(reader_limiter);
-            current_process.program_counter++;
-            break;
+inline int &shared_var(Simulation &sim, uint8_t id) {
+    return id == SHARED_READ_COUNT ? sim.read_count : sim.extra_shared[id - 1];
+}
 
-        case 13: // Finish
-            cout << "Reader " << pid << " finished." << endl;
-            current_process.status = FINISHED;
-            break;
-    }
+inline int shared_var(const Simulation &sim, uint8_t id) {
+    return id == SHARED_READ_COUNT ? sim.read_count : sim.extra_shared[id - 1];
 }
 
+// Step bodies shared by every engine (tables, protocol interpreter, coroutines).
+inline void cs_enter(Simulation &sim, int pid, int role) {
+    if (role == READER) sim.active_readers++;
+    else sim.active_writers++;
+    sim.dirty |= var_bit(role == READER ? VAR_ACTIVE_READERS : VAR_ACTIVE_WRITERS);
+    // REQUIREMENT: Report other readers/writers (the step's invariant check reports a PANIC)
+    trace_event(sim, role == READER ? EV_READER_ENTER : EV_WRITER_ENTER, pid, SEM_NONE,
+                sim.active_readers, sim.active_writers);
+    metrics_cs_enter(sim, pid);
+}
 
-////// --- WORKER FUNCTIONS END--- /////
+inline void cs_exit(Simulation &sim, int role) {
+    if (role == READER) sim.active_readers--;
+    else sim.active_writers--;
+    sim.dirty |= var_bit(role == READER ? VAR_ACTIVE_READERS : VAR_ACTIVE_WRITERS);
+}
 
-// SCHEDULER ---
+inline void shared_add(Simulation &sim, int var, int delta) {
+    shared_var(sim, var) += delta;
+    sim.dirty |= var_bit(VAR_SHARED_BASE + var);
+}
 
-int main() {
-    srand(time(0));
+inline void process_finish(Simulation &sim, int pid) {
+    trace_event(sim, sim.processes.type[pid] == READER ? EV_READER_FINISHED : EV_WRITER_FINISHED, pid);
+    metrics_finish(sim, pid);
+    set_status(sim, pid, FINISHED);
+}
 
-    // Initialize Processes
-    for(int i=0; i<6; i++) {
-        processes[i].id = i;
-        processes[i].program_counter = 0;
-        processes[i].status = READY;
-        processes[i].type = (i < 3) ? 0 : 1; // 0-2=Reader, 3-5=Writer
+// One step of instruction I, fully resolved at compile time: operands are
+// constants and only the branches I actually needs are emitted.
+template <Instruction I>
+void execute(Simulation &sim, int pid) {
+    int &program_counter = sim.processes.program_counter[pid];
+    if constexpr (I.op == OP_WAIT) {
+        // If we get the lock, we move manually.
+        // If we BLOCK, SemSignal will move us when we wake up.
+        if (SemWait(sim, semaphore(sim, I.sem), pid)) program_counter++;
+    } else if constexpr (I.op == OP_SIGNAL) {
+        SemSignal(sim, semaphore(sim, I.sem), pid);
+        program_counter++;
+    } else if constexpr (I.op == OP_WAIT_IF) {
+        if (shared_var(sim, I.var) != I.when || SemWait(sim, semaphore(sim, I.sem), pid)) program_counter++;
+    } else if constexpr (I.op == OP_SIGNAL_IF) {
+        if (shared_var(sim, I.var) == I.when) SemSignal(sim, semaphore(sim, I.sem), pid);
+        program_counter++;
+    } else if constexpr (I.op == OP_INC_SHARED) {
+        shared_add(sim, I.var, 1);
+        program_counter++;
+    } else if constexpr (I.op == OP_DEC_SHARED) {
+        shared_add(sim, I.var, -1);
+        program_counter++;
+    } else if constexpr (I.op == OP_ENTER_CS) {
+        cs_enter(sim, pid, I.var);
+        program_counter++;
+    } else if constexpr (I.op == OP_EXIT_CS) {
+        cs_exit(sim, I.var);
+        if constexpr (I.sem != SEM_NONE) SemSignal(sim, semaphore(sim, I.sem), pid);
+        program_counter++;
+    } else if constexpr (I.op == OP_BUSY) {
+        trace_event(sim, EV_READER_BUSY, pid);
+        program_counter++;
+    } else if constexpr (I.op == OP_FINISH) {
+        process_finish(sim, pid);
     }
+}
 
-    int completed = 0;
-    while (completed < 6) {
-        // Pick random process
-        int pid = rand() % 6;
-
-        // run if READY
-        if (processes[pid].status == READY) {
-            if (processes[pid].type == 0) {
-                run_reader(pid);
-            } else {
-                run_writer(pid);
+using StepFn = void (*)(Simulation &, int);
+
+template <const auto &Program, size_t... Pc>
+constexpr array<StepFn, sizeof...(Pc)> make_dispatch(index_sequence<Pc...>) {
+    return {&execute<Program[Pc]>...};
+}
+
+// program_counter -> specialized step, one table per program.
+template <const auto &Program>
+constexpr array<StepFn, size(Program)> DISPATCH = make_dispatch<Program>(make_index_sequence<size(Program)>{});
+
+// Function for WRITERS
+void run_writer(Simulation &sim, int pid) {
+    DISPATCH<WRITER_PROGRAM>[sim.processes.program_counter[pid]](sim, pid);
+}
+
+// Function for READERS
+void run_reader(Simulation &sim, int pid) {
+    DISPATCH<READER_PROGRAM>[sim.processes.program_counter[pid]](sim, pid);
+}
+
+
+////// --- WORKER FUNCTIONS END--- /////
+
+
+///// ---  COROUTINE BODIES START --- /////
+
+// The built-in programs written as straight-line coroutines (--coroutines).
+// Every co_await ends one scheduler step; a process that BLOCKs in sem_wait is
+// simply not resumed until SemSignal makes it READY again. program_counter is
+// still advanced step by step, so movers, footprints, the deadlock detector
+// and traces see the same state as with the instruction tables.
+
+// Coroutine frames by 16-byte size class, carved from 64 KiB slabs and
+// recycled through per-class free lists, so a million suspended processes cost
+// one frame each plus slab slack and no allocator calls after warm-up.
+// thread_local: every batch thread owns its Simulations and their frames.
+struct FramePool {
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t MAX_POOLED = 1024; // larger frames go to operator new
+    static constexpr size_t SLAB = 1 << 16;
+
+    void *free_list[MAX_POOLED / GRANULE + 1] = {};
+    vector<unique_ptr<char[]>> slabs;
+    char *cursor = nullptr;
+    char *slab_end = nullptr;
+    long live = 0;          // frames currently allocated
+    size_t frame_bytes = 0; // largest frame requested
+
+    void *allocate(size_t size) {
+        frame_bytes = max(frame_bytes, size);
+        if (size > MAX_POOLED) return ::operator new(size);
+        live++;
+        size_t cls = (size + GRANULE - 1) / GRANULE;
+        if (void *frame = free_list[cls]) {
+            free_list[cls] = *(void **) frame;
+            return frame;
+        }
+        size_t bytes = cls * GRANULE;
+        if (cursor == nullptr || (size_t) (slab_end - cursor) < bytes) {
+            slabs.emplace_back(new char[SLAB]);
+            cursor = slabs.back().get();
+            slab_end = cursor + SLAB;
+        }
+        void *frame = cursor;
+        cursor += bytes;
+        return frame;
+    }
+
+    void release(void *frame, size_t size) {
+        if (size > MAX_POOLED) return ::operator delete(frame);
+        live--;
+        size_t cls = (size + GRANULE - 1) / GRANULE;
+        *(void **) frame = free_list[cls];
+        free_list[cls] = frame;
+    }
+};
+
+thread_local FramePool frame_pool;
+
+// A process body: created suspended, resumed once per scheduler step. The
+// promise keeps (sim, pid) so the awaiters below carry no state of their own
+// and add next to nothing to the frame.
+struct ProcessBody {
+    struct promise_type {
+        Simulation &sim;
+        int pid;
+
+        promise_type(Simulation &s, int p) : sim(s), pid(p) {}
+
+        ProcessBody get_return_object() { return {coroutine_handle<promise_type>::from_promise(*this)}; }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+
+        static void *operator new(size_t size) { return frame_pool.allocate(size); }
+        static void operator delete(void *frame, size_t size) { frame_pool.release(frame, size); }
+    };
+
+    coroutine_handle<promise_type> handle;
+};
+
+using BodyHandle = coroutine_handle<ProcessBody::promise_type>;
+
+// End of a step that cannot block.
+struct NextStep {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(BodyHandle body) const noexcept {
+        body.promise().sim.processes.program_counter[body.promise().pid]++;
+    }
+    void await_resume() const noexcept {}
+};
+
+// SemWait as one step. If it BLOCKs, SemSignal moves program_counter on wake-up.
+struct SemWaitStep {
+    uint8_t sem;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(BodyHandle body) const {
+        Simulation &sim = body.promise().sim;
+        int pid = body.promise().pid;
+        if (SemWait(sim, semaphore(sim, sem), pid)) sim.processes.program_counter[pid]++;
+    }
+    void await_resume() const noexcept {}
+};
+
+inline NextStep next_step() { return {}; }
+inline SemWaitStep sem_wait(SemId sem) { return {sem}; }
+
+// WRITER_PROGRAM as a coroutine
+ProcessBody writer_body(Simulation &sim, int pid) {
+    co_await sem_wait(SEM_WRT);                     // Request Entry
+    cs_enter(sim, pid, WRITER);                         // CRITICAL SECTION (Writing)
+    co_await next_step();
+    cs_exit(sim, WRITER);                               // Exit Critical Section
+    SemSignal(sim, sim.wrt, pid);
+    co_await next_step();
+    process_finish(sim, pid);
+}
+
+// READER_PROGRAM as a coroutine
+ProcessBody reader_body(Simulation &sim, int pid) {
+    co_await sem_wait(SEM_READER_LIMITER);          // Check Reader Limit
+    co_await sem_wait(SEM_READ_COUNT_LOCK);         // Lock read_count
+    shared_add(sim, SHARED_READ_COUNT, 1);
+    co_await next_step();
+    if (sim.read_count == 1) co_await sem_wait(SEM_WRT); // First reader locks writer
+    else co_await next_step();
+    SemSignal(sim, sim.read_count_lock, pid);
+    co_await next_step();
+    cs_enter(sim, pid, READER);                         // CRITICAL SECTION (Reading)
+    co_await next_step();
+    trace_event(sim, EV_READER_BUSY, pid);              // Busy work while holding the lock
+    co_await next_step();
+    cs_exit(sim, READER);                               // Exit CS
+    co_await next_step();
+    co_await sem_wait(SEM_READ_COUNT_LOCK);         // Lock read_count for exit
+    shared_add(sim, SHARED_READ_COUNT, -1);
+    co_await next_step();
+    if (sim.read_count == 0) SemSignal(sim, sim.wrt, pid); // Last reader releases writer
+    co_await next_step();
+    SemSignal(sim, sim.read_count_lock, pid);
+    co_await next_step();
+    SemSignal(sim, sim.reader_limiter, pid);               // Release slot for other readers
+    co_await next_step();
+    process_finish(sim, pid);
+}
+
+///// ---  COROUTINE BODIES END ----- /////
+
+
+///// ---  PROTOCOL FILES START --- /////
+
+// A protocol file declares semaphores, shared variables and the programs run
+// by readers and writers, one instruction per line ('#' starts a comment):
+//
+//   sem NAME VALUE|limit         (limit = the --limit reader capacity)
+//   shared NAME
+//   invariant NAME LHS <=|<|>=|>|==|!= RHS
+//                                (operands: semaphore values, shared variables,
+//                                 active_readers, active_writers, limit or numbers)
+//   program reader|writer
+//       wait S | signal S | wait_if S VAR N | signal_if S VAR N
+//       inc VAR | dec VAR | enter_cs reader|writer | exit_cs reader|writer [S]
+//       busy | finish
+//       wait_timed S T|timeout LABEL (--clock: give up after T, or --timeout,
+//                                     units of virtual time and go to LABEL)
+//       LABEL:                       (names the next instruction)
+//   end
+//
+// read_count_lock, wrt, reader_limiter and read_count always exist (with the
+// built-in initial values unless redeclared), and the built-in Critical Section
+// invariants always apply; see protocols/ for examples.
+
+const int INITIAL_LIMIT = INT_MIN; // sem initial value placeholder for --limit
+const int PROTOCOL_MAX_SEMAPHORES = MAX_SEMAPHORES;
+const int PROTOCOL_MAX_SHARED = 30;
+static_assert(PROTOCOL_MAX_SEMAPHORES <= VAR_SHARED_BASE && VAR_SHARED_BASE + PROTOCOL_MAX_SHARED <= VAR_ACTIVE_READERS,
+              "state variable bit ranges must not overlap");
+
+// One program compiled for the threaded interpreter: handler[i] is the label
+// address dsl_execute jumps to for code[i].
+struct DslProgram {
+    vector<Instruction> code;
+    vector<const void *> handler;
+    vector<uint32_t> future_signals; // see future_signals()
+};
+
+struct Protocol {
+    vector<string> sem_names = {"read_count_lock", "wrt", "reader_limiter"}; // index = SemId
+    vector<int> sem_initial = {1, 1, INITIAL_LIMIT};
+    vector<string> shared_names = {"read_count"};                          // index = SharedVar
+    DslProgram programs[2];                                                // indexed by ProcType
+    InvariantSet invariants = BUILTIN_INVARIANTS;                          // plus the file's own
+    bool timed_waits = false;                                              // some program uses wait_timed
+};
+
+int state_value(const Simulation &sim, int var) {
+    if (var == VAR_ACTIVE_READERS) return sim.active_readers;
+    if (var == VAR_ACTIVE_WRITERS) return sim.active_writers;
+    if (var >= VAR_SHARED_BASE) return shared_var(sim, var - VAR_SHARED_BASE);
+    return semaphore(sim, var).value;
+}
+
+int term_value(const Simulation &sim, InvariantTerm term) {
+    switch (term.kind) {
+        case TERM_LIMIT: return sim.reader_limit;
+        case TERM_VAR: return state_value(sim, term.value);
+        default: return term.value;
+    }
+}
+
+bool compare_holds(const Simulation &sim, const Invariant &self) {
+    int lhs = term_value(sim, self.lhs), rhs = term_value(sim, self.rhs);
+    switch (self.compare) {
+        case CMP_LE: return lhs <= rhs;
+        case CMP_LT: return lhs < rhs;
+        case CMP_GE: return lhs >= rhs;
+        case CMP_GT: return lhs > rhs;
+        case CMP_EQ: return lhs == rhs;
+        default: return lhs != rhs;
+    }
+}
+
+// Direct-threaded interpreter: every instruction already holds the address of
+// its handler, so one step is a single indirect jump with no opcode switch.
+// Label addresses only exist inside this function, so calling it with
+// sim == nullptr just returns the handler table, indexed by Op.
+const void *const *dsl_execute(Simulation *sim, const DslProgram &program, int pid) {
+    static const void *const HANDLERS[] = {
+        &&op_wait, &&op_signal, &&op_wait_if, &&op_signal_if, &&op_inc_shared, &&op_dec_shared,
+        &&op_enter_cs, &&op_exit_cs, &&op_busy, &&op_finish, &&op_wait_timed
+    };
+    if (!sim) return HANDLERS;
+
+    int &program_counter = sim->processes.program_counter[pid];
+    const Instruction &ins = program.code[program_counter];
+    goto *program.handler[program_counter];
+
+op_wait:
+    if (SemWait(*sim, semaphore(*sim, ins.sem), pid)) program_counter++;
+    return nullptr;
+op_signal:
+    SemSignal(*sim, semaphore(*sim, ins.sem), pid);
+    program_counter++;
+    return nullptr;
+op_wait_if:
+    if (shared_var(*sim, ins.var) != ins.when || SemWait(*sim, semaphore(*sim, ins.sem), pid)) program_counter++;
+    return nullptr;
+op_signal_if:
+    if (shared_var(*sim, ins.var) == ins.when) SemSignal(*sim, semaphore(*sim, ins.sem), pid);
+    program_counter++;
+    return nullptr;
+op_inc_shared:
+    shared_add(*sim, ins.var, 1);
+    program_counter++;
+    return nullptr;
+op_dec_shared:
+    shared_add(*sim, ins.var, -1);
+    program_counter++;
+    return nullptr;
+op_enter_cs:
+    cs_enter(*sim, pid, ins.var);
+    program_counter++;
+    return nullptr;
+op_exit_cs:
+    cs_exit(*sim, ins.var);
+    if (ins.sem != SEM_NONE) SemSignal(*sim, semaphore(*sim, ins.sem), pid);
+    program_counter++;
+    return nullptr;
+op_busy:
+    trace_event(*sim, EV_READER_BUSY, pid);
+    program_counter++;
+    return nullptr;
+op_finish:
+    process_finish(*sim, pid);
+    return nullptr;
+op_wait_timed:
+    if (SemWait(*sim, semaphore(*sim, ins.sem), pid, ins.timeout == TIMEOUT_OPTION ? sim->wait_timeout : ins.timeout)) {
+        program_counter++;
+    }
+    return nullptr;
+}
+
+// Whole of text as a base-10 integer in [lo, hi]; false on junk, overflow or range.
+bool parse_number(const string &text, long lo, long hi, long &out) {
+    char *end;
+    errno = 0;
+    long n = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end || errno == ERANGE || n < lo || n > hi) return false;
+    out = n;
+    return true;
+}
+
+int find_name(const vector<string> &names, const string &name) {
+    auto it = find(names.begin(), names.end(), name);
+    return it == names.end() ? -1 : (int) (it - names.begin());
+}
+
+// Parse path into protocol; on failure error says which line and why.
+bool load_protocol(const string &path, Protocol &protocol, string &error) {
+    ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    DslProgram *current = nullptr;
+    bool defined[2] = {false, false};
+    vector<pair<string, int>> labels; // of the current program: name, pc
+    vector<pair<string, int>> jumps;  // its timed waits: target label, line number
+    string line;
+    for (int line_no = 1; getline(in, line); line_no++) {
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        vector<string> w;
+        for (string word; words >> word;) w.push_back(word);
+        if (w.empty()) continue;
+
+        auto fail = [&](const string &message) {
+            error = path + ":" + to_string(line_no) + ": " + message;
+            return false;
+        };
+        auto sem_operand = [&](const string &name, uint8_t &out) {
+            int id = find_name(protocol.sem_names, name);
+            if (id < 0) return fail("unknown semaphore '" + name + "'");
+            out = (uint8_t) id;
+            return true;
+        };
+        auto var_operand = [&](const string &name, uint8_t &out) {
+            int id = find_name(protocol.shared_names, name);
+            if (id < 0) return fail("unknown shared variable '" + name + "'");
+            out = (uint8_t) id;
+            return true;
+        };
+        auto role_operand = [&](const string &name, uint8_t &out) {
+            if (name != "reader" && name != "writer") return fail("expected reader or writer, got '" + name + "'");
+            out = name == "reader" ? READER : WRITER;
+            return true;
+        };
+        auto term_operand = [&](const string &name, InvariantTerm &out) {
+            int id;
+            long constant;
+            if (name == "limit") out = {TERM_LIMIT};
+            else if (name == "active_readers") out = {TERM_VAR, VAR_ACTIVE_READERS};
+            else if (name == "active_writers") out = {TERM_VAR, VAR_ACTIVE_WRITERS};
+            else if ((id = find_name(protocol.sem_names, name)) >= 0) out = {TERM_VAR, id};
+            else if ((id = find_name(protocol.shared_names, name)) >= 0) out = {TERM_VAR, VAR_SHARED_BASE + id};
+            else if (parse_number(name, INT_MIN, INT_MAX, constant)) out = {TERM_CONSTANT, (int) constant};
+            else if (isdigit((unsigned char) name[0]) || name[0] == '-') return fail("bad constant '" + name + "'");
+            else return fail("unknown invariant operand '" + name + "'");
+            return true;
+        };
+
+        const string &op = w[0];
+        size_t operands = w.size() - 1;
+        if (!current) {
+            if (op == "sem" && operands == 2) {
+                int id = find_name(protocol.sem_names, w[1]);
+                if (id < 0) {
+                    if ((int) protocol.sem_names.size() >= PROTOCOL_MAX_SEMAPHORES) return fail("too many semaphores");
+                    id = (int) protocol.sem_names.size();
+                    protocol.sem_names.push_back(w[1]);
+                    protocol.sem_initial.push_back(0);
+                }
+                long initial = INITIAL_LIMIT;
+                if (w[2] != "limit" && !parse_number(w[2], 0, INT_MAX, initial)) {
+                    return fail("bad initial value '" + w[2] + "'");
+                }
+                protocol.sem_initial[id] = (int) initial;
+            } else if (op == "shared" && operands == 1) {
+                if (find_name(protocol.shared_names, w[1]) >= 0) continue;
+                if ((int) protocol.shared_names.size() >= PROTOCOL_MAX_SHARED) return fail("too many shared variables");
+                protocol.shared_names.push_back(w[1]);
+            } else if (op == "invariant" && operands == 4) {
+                static const char *const COMPARES[] = {"<=", "<", ">=", ">", "==", "!="};
+                auto it = find(begin(COMPARES), end(COMPARES), w[3]);
+                if (it == end(COMPARES)) return fail("unknown comparison '" + w[3] + "'");
+                Invariant inv{w[1]};
+                inv.holds = compare_holds;
+                inv.compare = (Compare) (it - begin(COMPARES));
+                if (!term_operand(w[2], inv.lhs) || !term_operand(w[4], inv.rhs)) return false;
+                for (InvariantTerm term : {inv.lhs, inv.rhs}) {
+                    if (term.kind == TERM_VAR) inv.depends |= var_bit(term.value);
+                }
+                if (!add_invariant(protocol.invariants, inv)) return fail("too many invariants");
+            } else if (op == "program" && operands == 1) {
+                uint8_t role;
+                if (!role_operand(w[1], role)) return false;
+                if (defined[role]) return fail("program " + w[1] + " defined twice");
+                defined[role] = true;
+                current = &protocol.programs[role];
+                labels.clear();
+                jumps.clear();
+            } else {
+                return fail("expected sem, shared, invariant or program, got '" + line + "'");
+            }
+            continue;
+        }
+
+        Instruction ins{OP_BUSY};
+        bool ok = true;
+        if (op == "end" && operands == 0) {
+            if (current->code.empty() || current->code.back().op != OP_FINISH) return fail("program must end with finish");
+            for (auto &[name, pc] : labels) {
+                if (pc == (int) current->code.size()) return fail("label " + name + " names no instruction");
+            }
+            size_t jump = 0;
+            for (Instruction &timed : current->code) {
+                if (timed.op != OP_WAIT_TIMED) continue;
+                auto [name, jump_line] = jumps[jump++];
+                auto it = find_if(labels.begin(), labels.end(), [&](auto &label) { return label.first == name; });
+                if (it == labels.end()) {
+                    error = path + ":" + to_string(jump_line) + ": unknown label '" + name + "'";
+                    return false;
+                }
+                timed.target = (uint16_t) it->second;
+            }
+            current = nullptr;
+            continue;
+        } else if (operands == 0 && op.size() > 1 && op.back() == ':') {
+            string name = op.substr(0, op.size() - 1);
+            if (find_if(labels.begin(), labels.end(), [&](auto &label) { return label.first == name; }) != labels.end()) {
+                return fail("label " + name + " defined twice");
+            }
+            labels.push_back({name, (int) current->code.size()});
+            continue;
+        } else if (op == "wait_timed" && operands == 3) {
+            ins.op = OP_WAIT_TIMED;
+            long timeout = TIMEOUT_OPTION;
+            if (w[2] != "timeout" && !parse_number(w[2], 0, INT32_MAX, timeout)) return fail("bad timeout '" + w[2] + "'");
+            ins.timeout = (int32_t) timeout;
+            jumps.push_back({w[3], line_no});
+            protocol.timed_waits = true;
+            ok = sem_operand(w[1], ins.sem);
+        } else if ((op == "wait" || op == "signal") && operands == 1) {
+            ins.op = op == "wait" ? OP_WAIT : OP_SIGNAL;
+            ok = sem_operand(w[1], ins.sem);
+        } else if ((op == "wait_if" || op == "signal_if") && operands == 3) {
+            ins.op = op == "wait_if" ? OP_WAIT_IF : OP_SIGNAL_IF;
+            long when;
+            if (!parse_number(w[3], INT8_MIN, INT8_MAX, when)) return fail("bad value '" + w[3] + "'");
+            ins.when = (int8_t) when;
+            ok = sem_operand(w[1], ins.sem) && var_operand(w[2], ins.var);
+        } else if ((op == "inc" || op == "dec") && operands == 1) {
+            ins.op = op == "inc" ? OP_INC_SHARED : OP_DEC_SHARED;
+            ok = var_operand(w[1], ins.var);
+        } else if (op == "enter_cs" && operands == 1) {
+            ins.op = OP_ENTER_CS;
+            ok = role_operand(w[1], ins.var);
+        } else if (op == "exit_cs" && (operands == 1 || operands == 2)) {
+            ins.op = OP_EXIT_CS;
+            ok = role_operand(w[1], ins.var) && (operands == 1 || sem_operand(w[2], ins.sem));
+        } else if (op == "busy" && operands == 0) {
+            ins.op = OP_BUSY;
+        } else if (op == "finish" && operands == 0) {
+            ins.op = OP_FINISH;
+        } else {
+            return fail("unknown instruction '" + line + "'");
+        }
+        if (!ok) return false;
+        current->code.push_back(ins);
+    }
+
+    if (current) {
+        error = path + ": missing end";
+        return false;
+    }
+    if (!defined[READER] || !defined[WRITER]) {
+        error = path + ": needs both a reader and a writer program";
+        return false;
+    }
+
+    // Thread the code: resolve every opcode to its handler address once, up front.
+    const void *const *handlers = dsl_execute(nullptr, protocol.programs[READER], 0);
+    for (DslProgram &program : protocol.programs) {
+        program.handler.clear();
+        for (const Instruction &ins : program.code) program.handler.push_back(handlers[ins.op]);
+        program.future_signals = future_signals(program.code.data(), program.code.size());
+    }
+    return true;
+}
+
+const Instruction &next_instruction(const Simulation &sim, int pid) {
+    int pc = sim.processes.program_counter[pid];
+    if (sim.protocol) return sim.protocol->programs[sim.processes.type[pid]].code[pc];
+    return PROGRAMS[sim.processes.type[pid]][pc];
+}
+
+///// ---  PROTOCOL FILES END ----- /////
+
+
+///// ---  DEADLOCK DETECTOR START --- /////
+
+// Semaphores pid may still signal from where its program is now.
+inline uint32_t signal_mask(const Simulation &sim, int pid) {
+    return sim.wait_for.future_signals[sim.processes.type[pid]][sim.processes.program_counter[pid]];
+}
+
+// Greatest fixpoint from t: true if every process that could still signal t is
+// BLOCKED, and the same holds for every semaphore those processes wait on.
+// Only the part of the graph reachable from t is visited.
+bool wait_for_stuck(const WaitForGraph &graph, int t) {
+    uint32_t seen = 1u << t, todo = seen;
+    while (todo) {
+        int s = __builtin_ctz(todo);
+        todo &= todo - 1;
+        if (graph.blocked_signalers[s] != graph.can_signal[s]) return false;
+        const int *row = &graph.blocked_on[s * graph.semaphores];
+        for (int u = 0; u < graph.semaphores; u++) {
+            if (row[u] > 0 && !(seen & (1u << u))) {
+                seen |= 1u << u;
+                todo |= 1u << u;
+            }
+        }
+    }
+    return true;
+}
+
+void wait_for_reset(Simulation &sim) {
+    WaitForGraph &graph = sim.wait_for;
+    graph.semaphores = SEM_BUILTIN_COUNT + (int) sim.extra_semaphores.size();
+    graph.can_signal.assign(graph.semaphores, 0);
+    graph.blocked_signalers.assign(graph.semaphores, 0);
+    graph.blocked_on.assign(graph.semaphores * graph.semaphores, 0);
+    graph.stuck = SEM_NONE;
+    for (int type : {READER, WRITER}) {
+        graph.future_signals[type] = sim.protocol ? sim.protocol->programs[type].future_signals.data()
+                                                  : BUILTIN_FUTURE_SIGNALS[type].data();
+    }
+    for (int pid = 0; pid < sim.processes.size(); pid++) {
+        for (uint32_t m = signal_mask(sim, pid); m; m &= m - 1) graph.can_signal[__builtin_ctz(m)]++;
+    }
+}
+
+// A timed waiter is left out of the graph: it runs again either way.
+inline bool timed_waiter(const Simulation &sim, int pid) { return sim.timers && sim.timers->armed(pid); }
+
+void wait_for_blocked(Simulation &sim, int pid, int sem) {
+    sim.processes.waiting_on[pid] = (uint8_t) sem;
+    if (!sim.detect_deadlock || timed_waiter(sim, pid)) return;
+    WaitForGraph &graph = sim.wait_for;
+    for (uint32_t m = signal_mask(sim, pid); m; m &= m - 1) {
+        int s = __builtin_ctz(m);
+        graph.blocked_signalers[s]++;
+        graph.blocked_on[s * graph.semaphores + sem]++;
+    }
+    if (graph.stuck == SEM_NONE && wait_for_stuck(graph, sem)) graph.stuck = (uint8_t) sem;
+}
+
+// pid ran (or was moved) from a point where it could still signal before to one
+// where it can signal after; a semaphore losing a signaler may now be stuck.
+void wait_for_progress(Simulation &sim, uint32_t before, uint32_t after) {
+    WaitForGraph &graph = sim.wait_for;
+    for (uint32_t lost = before & ~after; lost; lost &= lost - 1) {
+        int s = __builtin_ctz(lost);
+        graph.can_signal[s]--;
+        if (graph.stuck == SEM_NONE && !semaphore(sim, s).wait_queue.empty() && wait_for_stuck(graph, s)) {
+            graph.stuck = (uint8_t) s;
+        }
+    }
+}
+
+// pid was woken from sem and its program_counter already moved past the wait.
+void wait_for_woken(Simulation &sim, int pid, int sem) {
+    sim.processes.waiting_on[pid] = SEM_NONE;
+    if (!sim.detect_deadlock) return;
+    WaitForGraph &graph = sim.wait_for;
+    uint32_t before = graph.future_signals[sim.processes.type[pid]][sim.processes.program_counter[pid] - 1];
+    if (!timed_waiter(sim, pid)) {
+        for (uint32_t m = before; m; m &= m - 1) {
+            int s = __builtin_ctz(m);
+            graph.blocked_signalers[s]--;
+            graph.blocked_on[s * graph.semaphores + sem]--;
+        }
+    }
+    wait_for_progress(sim, before, signal_mask(sim, pid));
+}
+
+// Trace the processes behind a stuck semaphore: follow "waits on s for a
+// process that could signal s" until it closes a cycle or reaches a semaphore
+// nobody left can signal.
+void report_deadlock(Simulation &sim, int remaining) {
+    if (!sim.trace) return;
+    vector<pair<int, int>> chain; // (pid, semaphore it waits on)
+    vector<int> position(sim.processes.size(), -1);
+    int pid = semaphore(sim, sim.wait_for.stuck).wait_queue.head;
+    while (pid != -1 && position[pid] == -1) {
+        position[pid] = (int) chain.size();
+        int sem = sim.processes.waiting_on[pid];
+        chain.push_back({pid, sem});
+        int next = -1; // another process that could signal sem, else pid itself
+        for (int q = 0; q < sim.processes.size(); q++) {
+            if (sim.processes.status[q] == FINISHED || !(signal_mask(sim, q) & (1u << sem))) continue;
+            next = q;
+            if (q != pid) break;
+        }
+        pid = next;
+    }
+    int start = pid == -1 ? 0 : position[pid]; // drop the lead-in to the cycle
+    int length = (int) chain.size() - start;
+    trace_event(sim, EV_DEADLOCK, -1, SEM_NONE, remaining, length);
+    for (int i = start; i < (int) chain.size(); i++) {
+        int waits_for = i + 1 < (int) chain.size() ? chain[i + 1].first : pid;
+        trace_event(sim, EV_WAITS_FOR, chain[i].first, (uint8_t) chain[i].second, waits_for);
+    }
+}
+
+///// ---  DEADLOCK DETECTOR END ----- /////
+
+// SCHEDULER ---
+
+// Put sim back to its starting state for cfg. Vectors keep their capacity, so a
+// Simulation reused across trials allocates only on its first run.
+void reset_simulation(Simulation &sim, const Config &cfg) {
+    // Size the process table: pids [0, readers) are Readers, the rest Writers
+    int total = cfg.readers + cfg.writers;
+    sim.processes.program_counter.assign(total, 0);
+    sim.processes.status.assign(total, READY);
+    sim.processes.type.assign(total, WRITER);
+    fill(sim.processes.type.begin(), sim.processes.type.begin() + cfg.readers, READER);
+    sim.processes.wait_next.assign(total, -1);
+    sim.processes.wait_prev.assign(total, -1);
+    sim.processes.waiting_on.assign(total, SEM_NONE);
+
+    sim.ready_set.pids.assign(total, 0);
+    sim.ready_set.slot.assign(total, -1);
+    sim.ready_set.size = 0;
+    for (int i = 0; i < total; i++) set_status(sim, i, READY);
+
+    sim.read_count_lock.value = 1;
+    sim.wrt.value = 1;
+    sim.reader_limiter.value = cfg.reader_limit;
+    sim.read_count_lock.wait_queue = {};
+    sim.wrt.wait_queue = {};
+    sim.reader_limiter.wait_queue = {};
+
+    sim.active_readers = 0;
+    sim.active_writers = 0;
+    sim.read_count = 0;
+
+    sim.protocol = cfg.protocol;
+    sim.extra_semaphores.clear();
+    sim.extra_shared.clear();
+    if (cfg.protocol) {
+        const Protocol &protocol = *cfg.protocol;
+        for (int id = 0; id < (int) protocol.sem_names.size(); id++) {
+            int initial = protocol.sem_initial[id] == INITIAL_LIMIT ? cfg.reader_limit : protocol.sem_initial[id];
+            if (id < SEM_BUILTIN_COUNT) semaphore(sim, id).value = initial;
+            else sim.extra_semaphores.push_back({initial, {}, protocol.sem_names[id], (SemId) id});
+        }
+        sim.extra_shared.assign(protocol.shared_names.size() - 1, 0);
+    }
+    sim.reader_limit = cfg.reader_limit;
+    sim.wait_timeout = cfg.wait_timeout;
+    if (sim.timers) sim.timers->reset(total);
+
+    // The first step re-checks every invariant, so even the initial state is covered.
+    sim.invariants = cfg.protocol ? &cfg.protocol->invariants : &BUILTIN_INVARIANTS;
+    sim.dirty = ~0ull;
+    sim.violated = 0;
+
+    sim.detect_deadlock = true;
+    wait_for_reset(sim);
+
+    int semaphores = SEM_BUILTIN_COUNT + (int) sim.extra_semaphores.size();
+    for (int id = 0; id < semaphores; id++) semaphore(sim, id).policy = cfg.wake_policy[id];
+    metrics_reset(sim);
+
+    sim.coroutines = cfg.coroutines && !cfg.protocol;
+    sim.bodies.clear();
+    if (sim.coroutines) {
+        sim.bodies.handles.reserve(total);
+        for (int pid = 0; pid < total; pid++) {
+            sim.bodies.handles.push_back(pid < cfg.readers ? reader_body(sim, pid).handle : writer_body(sim, pid).handle);
+        }
+    }
+
+    sim.run_to_block = cfg.run_to_block;
+    sim.now = 0;
+    sim.steps = 0;
+    sim.dispatches = 0;
+    sim.blocks = 0;
+    sim.timeouts = 0;
+    sim.panics = 0;
+}
+
+// Seed trial's RNGs: the scheduler on stream (seed, trial), WAKE_RANDOM picks
+// on a stream of their own, so a random wake draws nothing from the scheduler
+// and --compare-wake gives every policy the same scheduler draws.
+void seed_trial(Simulation &sim, uint64_t seed, uint64_t trial) {
+    sim.rng.seed(seed, trial);
+    sim.wake_rng.seed(seed, trial ^ (1ull << 63));
+}
+
+inline void schedule_append(ScheduleLog &log, int pid) {
+    int delta = pid - log.last;
+    uint32_t zigzag = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+    while (zigzag >= 0x80) {
+        log.bytes.push_back((uint8_t) (zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    log.bytes.push_back((uint8_t) zigzag);
+    log.last = pid;
+    log.picks++;
+}
+
+// Run one scheduler step of pid (which must be READY).
+void step_process(Simulation &sim, int pid) {
+    uint32_t signals_before = sim.detect_deadlock ? signal_mask(sim, pid) : 0;
+    if (sim.coroutines) {
+        sim.bodies.handles[pid].resume();
+    } else if (sim.protocol) {
+        dsl_execute(&sim, sim.protocol->programs[sim.processes.type[pid]], pid);
+    } else if (sim.processes.type[pid] == READER) {
+        run_reader(sim, pid);
+    } else {
+        run_writer(sim, pid);
+    }
+    if (sim.dirty) check_invariants(sim);
+    if (signals_before) wait_for_progress(sim, signals_before, signal_mask(sim, pid));
+    sim.steps++;
+}
+
+// How the next step of pid commutes with steps of other processes (Lipton).
+// A SemWait can always be delayed past others' steps (moves right), a
+// SemSignal can always be done earlier (moves left), shared counters are only
+// touched under a lock (read_count_lock) and busy work/finish touch nothing (both).
+// A step that changes a variable some invariant reads (CS entry/exit for the
+// built-in rules) moves neither way, so no violating interleaving is skipped.
+enum Mover : uint8_t { MOVER_BOTH, MOVER_RIGHT, MOVER_LEFT, MOVER_NONE };
+
+Mover next_mover(const Simulation &sim, int pid) {
+    const Instruction &next = next_instruction(sim, pid);
+    uint64_t touches = next.sem == SEM_NONE ? 0 : var_bit(next.sem);
+    if (next.op == OP_INC_SHARED || next.op == OP_DEC_SHARED) touches |= var_bit(VAR_SHARED_BASE + next.var);
+    if (touches & sim.invariants->watched) return MOVER_NONE;
+    switch (next.op) {
+        case OP_WAIT: case OP_WAIT_TIMED: return MOVER_RIGHT;
+        case OP_SIGNAL: return MOVER_LEFT;
+        case OP_WAIT_IF: return shared_var(sim, next.var) == next.when ? MOVER_RIGHT : MOVER_BOTH;
+        case OP_SIGNAL_IF: return shared_var(sim, next.var) == next.when ? MOVER_LEFT : MOVER_BOTH;
+        case OP_ENTER_CS: case OP_EXIT_CS: return MOVER_NONE;
+        // Built-in programs only touch read_count under read_count_lock; a
+        // protocol file promises no such thing.
+        case OP_INC_SHARED: case OP_DEC_SHARED: return sim.protocol ? MOVER_NONE : MOVER_BOTH;
+        default: return MOVER_BOTH; // busy work, finish
+    }
+}
+
+// Whether the next step of pid is a wait that may block it.
+bool next_may_wait(const Simulation &sim, int pid) {
+    const Instruction &next = next_instruction(sim, pid);
+    if (next.op == OP_WAIT_IF) return shared_var(sim, next.var) == next.when;
+    return next.op == OP_WAIT || next.op == OP_WAIT_TIMED;
+}
+
+// One scheduler pick. Normally a single step; with run_to_block, pid keeps
+// running through a block of the form [one wait] (both movers)* [one non-mover]
+// (left movers)*, stopping early if it BLOCKs or finishes. Such a block can be
+// treated as atomic without losing any reachable panic or deadlock, so
+// preemption is only modeled between blocks. A wait may only lead a block: a
+// later one can leave pid BLOCKED half-way with the block's earlier steps done
+// (say, holding one lock while waiting for another), which no atomic block
+// would show, and that hides deadlocks such as AB/BA locking.
+void dispatch_process(Simulation &sim, int pid) {
+    sim.dispatches++;
+    bool started = false;   // a step already ran in this block
+    bool committed = false; // a non-mover or left mover already ran in this block
+    do {
+        Mover mover = next_mover(sim, pid);
+        if (committed && (mover == MOVER_RIGHT || mover == MOVER_NONE)) break;
+        if (started && next_may_wait(sim, pid)) break;
+        step_process(sim, pid);
+        started = true;
+        if (mover == MOVER_LEFT || mover == MOVER_NONE) committed = true;
+    } while (sim.run_to_block && sim.processes.status[pid] == READY);
+}
+
+// True (and traced) if the remaining live processes can no longer all finish.
+bool check_deadlock(Simulation &sim, int remaining) {
+    // Some BLOCKED processes can only be woken by each other: stop right away.
+    if (sim.wait_for.stuck != SEM_NONE) {
+        report_deadlock(sim, remaining);
+        return true;
+    }
+    // Nobody can run but not everyone finished: every live process is BLOCKED
+    // (and none of them on a timed wait that will give up).
+    if (sim.ready_set.size == 0 && !(sim.timers && sim.timers->pending)) {
+        trace_event(sim, EV_DEADLOCK, -1, SEM_NONE, remaining);
+        return true;
+    }
+    return false;
+}
+
+// Run sim to completion (or until every live process is BLOCKED).
+TrialResult run_simulation(Simulation &sim) {
+    int total = sim.processes.size();
+    // A paused or restored run may have finished some already.
+    int completed = count(sim.processes.status.begin(), sim.processes.status.end(), FINISHED);
+    bool deadlocked = false;
+    while (completed < total && sim.steps < sim.pause_at) {
+        if (check_deadlock(sim, total - completed)) {
+            deadlocked = true;
+            break;
+        }
+
+        // Pick random READY process (same distribution as redrawing until READY)
+        int pid = sim.ready_set.pids[sim.rng.below(sim.ready_set.size)];
+        if (sim.schedule) schedule_append(*sim.schedule, pid);
+        dispatch_process(sim, pid);
+
+        // Update completion count (FINISHED already left the READY set)
+        if (sim.processes.status[pid] == FINISHED) completed++;
+    }
+    return {sim.steps, sim.dispatches, sim.blocks, sim.panics, deadlocked};
+}
+
+///// ---  VIRTUAL CLOCK START --- /////
+
+// --clock: instead of drawing a random READY process per step, run whichever
+// is due first. A process that runs an instruction at time t is due again at
+// t + the instruction's duration; one woken by SemSignal is due at once, its
+// SemWait having completed. Time is in abstract units (e.g. ns), durations
+// come from Config::durations, drawn from the trial's RNG when a range.
+long instruction_duration(Simulation &sim, Op op) {
+    const Duration &d = (*sim.durations)[op];
+    return d.lo == d.hi ? d.lo : d.lo + (long) sim.rng.below((uint32_t) (d.hi - d.lo + 1));
+}
+
+// Every timed wait due at sim.now gives up: it leaves the wait queue, undoes
+// its sem.value--, and its process resumes at the wait's target right away.
+void expire_timers(Simulation &sim) {
+    TimerWheel &timers = *sim.timers;
+    for (int pid = timers.head[sim.now % TIMER_SLOTS], next; pid != -1; pid = next) {
+        next = timers.next[pid];
+        if (timers.deadline[pid] != sim.now) continue; // a later revolution
+        SimSemaphore &sem = semaphore(sim, sim.processes.waiting_on[pid]);
+        wait_unlink(sim.processes, sem.wait_queue, pid);
+        sem.value++;
+        sim.dirty |= var_bit(sem.id);
+        timers.cancel(pid);
+        sim.processes.waiting_on[pid] = SEM_NONE;
+
+        int &program_counter = sim.processes.program_counter[pid];
+        uint32_t signals_before = sim.detect_deadlock ? signal_mask(sim, pid) : 0;
+        program_counter = next_instruction(sim, pid).target;
+        if (signals_before) wait_for_progress(sim, signals_before, signal_mask(sim, pid));
+        set_status(sim, pid, READY);
+        sim.events->push(sim.now, pid);
+        sim.timeouts++;
+        trace_event(sim, EV_TIMED_OUT, pid, sem.id);
+        metrics_timeout(sim, sem, pid);
+    }
+    if (sim.dirty) check_invariants(sim);
+}
+
+// run_simulation in virtual time; sim.events must be set, and sim.timers too
+// if the programs use timed waits.
+TrialResult run_clocked(Simulation &sim) {
+    EventQueue &events = *sim.events;
+    events.clear();
+    int total = sim.processes.size();
+    for (int pid = 0; pid < total; pid++) {
+        if (sim.processes.status[pid] == READY) events.push(sim.now, pid);
+    }
+    int completed = count(sim.processes.status.begin(), sim.processes.status.end(), FINISHED);
+    bool deadlocked = false;
+    while (completed < total) {
+        if (check_deadlock(sim, total - completed)) {
+            deadlocked = true;
+            break;
+        }
+
+        // A deadline no later than the next event fires first.
+        if (sim.timers && sim.timers->pending) {
+            long due = sim.timers->earliest(events.size ? (long) events.top() : LONG_MAX);
+            if (due >= 0) {
+                sim.now = due;
+                expire_timers(sim);
+                continue;
+            }
+        }
+
+        auto [time, pid] = events.pop();
+        sim.now = time;
+        Op op = next_instruction(sim, pid).op;
+        sim.dispatches++;
+        step_process(sim, pid);
+
+        Status status = sim.processes.status[pid];
+        if (status == READY) events.push(sim.now + instruction_duration(sim, op), pid);
+        else if (status == FINISHED) completed++;
+    }
+    return {sim.steps, sim.dispatches, sim.blocks, sim.panics, deadlocked, sim.now, sim.timeouts};
+}
+
+// "op=N" or "op=LO-HI" for one Op, or "all=..." for every one.
+bool parse_duration(const string &value, Config &cfg) {
+    size_t eq = value.find('=');
+    if (eq == string::npos) return false;
+    string name = value.substr(0, eq), range = value.substr(eq + 1);
+    Duration d;
+    size_t dash = range.find('-');
+    if (!parse_number(range.substr(0, dash), 0, MAX_DURATION, d.lo)) return false;
+    d.hi = d.lo;
+    if (dash != string::npos && !parse_number(range.substr(dash + 1), d.lo, MAX_DURATION, d.hi)) return false;
+    if (d.hi - d.lo >= UINT32_MAX) return false; // instruction_duration draws hi - lo + 1 as a uint32_t
+    bool found = false;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (name != "all" && name != OP_NAMES[op]) continue;
+        cfg.durations[op] = d;
+        found = true;
+    }
+    return found;
+}
+
+///// ---  VIRTUAL CLOCK END ----- /////
+
+// Names of every semaphore cfg runs with, indexed by SemId.
+vector<string> semaphore_names(const Config &cfg) {
+    if (cfg.protocol) return cfg.protocol->sem_names;
+    return vector<string>(begin(SEM_NAMES), end(SEM_NAMES));
+}
+
+///// ---  TRIAL POOL START --- /////
+
+// Work-stealing over trial indices [0, trials) in chunks of TRIAL_CHUNK, for
+// batches whose trials vary wildly in length. Every worker starts out owning
+// an equal run of chunks, kept as one atomic word (next chunk, end chunk):
+// the owner takes chunks off the front, and a worker whose run is empty
+// steals the back half of another's. Both sides CAS the same word, so no
+// locks are taken; a worker finds nothing left to steal only once every
+// chunk has been claimed.
+const long TRIAL_CHUNK = 32;
+
+struct alignas(64) ChunkRange { // one cache line per worker so owners don't contend
+    atomic<uint64_t> range{0};
+};
+
+inline uint64_t chunk_range(uint32_t next, uint32_t end) { return (uint64_t) end << 32 | next; }
+
+struct TrialPool {
+    long trials;
+    int workers;
+    vector<ChunkRange> ranges;
+
+    TrialPool(long trials, int workers) : trials(trials), workers(workers), ranges(workers) {
+        long chunks = (trials + TRIAL_CHUNK - 1) / TRIAL_CHUNK;
+        for (int w = 0; w < workers; w++) {
+            ranges[w].range.store(chunk_range(chunks * w / workers, chunks * (w + 1) / workers), memory_order_relaxed);
+        }
+    }
+
+    // Owner side: the next chunk of worker w's run, false once it is empty.
+    bool take(int w, uint32_t &chunk) {
+        atomic<uint64_t> &range = ranges[w].range;
+        uint64_t current = range.load(memory_order_acquire);
+        for (;;) {
+            uint32_t next = (uint32_t) current, end = (uint32_t) (current >> 32);
+            if (next >= end) return false;
+            if (range.compare_exchange_weak(current, chunk_range(next + 1, end), memory_order_acq_rel)) {
+                chunk = next;
+                return true;
+            }
+        }
+    }
+
+    // Thief side: move the back half of some other worker's run into w's.
+    bool steal(int w) {
+        for (int i = 1; i < workers; i++) {
+            atomic<uint64_t> &victim = ranges[(w + i) % workers].range;
+            uint64_t current = victim.load(memory_order_acquire);
+            for (;;) {
+                uint32_t next = (uint32_t) current, end = (uint32_t) (current >> 32);
+                if (next >= end) break;
+                uint32_t middle = next + (end - next) / 2;
+                if (victim.compare_exchange_weak(current, chunk_range(next, middle), memory_order_acq_rel)) {
+                    ranges[w].range.store(chunk_range(middle, end), memory_order_release);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Trials [first, last) of the next chunk worker w takes or steals; false when none are left.
+    bool next(int w, long &first, long &last) {
+        uint32_t chunk;
+        while (!take(w, chunk)) {
+            if (!steal(w)) return false;
+        }
+        first = chunk * TRIAL_CHUNK;
+        last = min(first + TRIAL_CHUNK, trials);
+        return true;
+    }
+
+    // Worker w's loop: body(first, last) for each chunk it takes or steals.
+    template <typename Body>
+    void run(int w, Body body) {
+        for (long first, last; next(w, first, last);) body(first, last);
+    }
+};
+
+///// ---  TRIAL POOL END ----- /////
+
+// One worker's share of a batch; reduced after the workers join.
+struct BatchTotals {
+    long panic_trials = 0, total_panics = 0, deadlocks = 0;
+    long total_steps = 0, total_dispatches = 0, total_blocks = 0;
+    long min_steps = LONG_MAX, max_steps = 0;
+    long first_panic = LONG_MAX, first_deadlock = LONG_MAX;
+    long total_time = 0, max_time = 0; // --clock, of the trials that completed
+    long total_timeouts = 0;
+
+    void add(long trial, const TrialResult &r) {
+        total_panics += r.panics;
+        total_timeouts += r.timeouts;
+        if (r.panics > 0) {
+            panic_trials++;
+            first_panic = min(first_panic, trial);
+        }
+        if (r.deadlocked) {
+            deadlocks++;
+            first_deadlock = min(first_deadlock, trial);
+        }
+        total_blocks += r.blocks;
+        total_dispatches += r.dispatches;
+        if (!r.deadlocked) {
+            total_steps += r.steps;
+            min_steps = min(min_steps, r.steps);
+            max_steps = max(max_steps, r.steps);
+            total_time += r.time;
+            max_time = max(max_time, r.time);
+        }
+    }
+
+    void merge(const BatchTotals &other) {
+        panic_trials += other.panic_trials;
+        total_panics += other.total_panics;
+        deadlocks += other.deadlocks;
+        total_steps += other.total_steps;
+        total_dispatches += other.total_dispatches;
+        total_blocks += other.total_blocks;
+        min_steps = min(min_steps, other.min_steps);
+        max_steps = max(max_steps, other.max_steps);
+        first_panic = min(first_panic, other.first_panic);
+        first_deadlock = min(first_deadlock, other.first_deadlock);
+        total_time += other.total_time;
+        max_time = max(max_time, other.max_time);
+        total_timeouts += other.total_timeouts;
+    }
+};
+
+void print_batch(const Config &cfg, uint64_t seed, const BatchTotals &all, int workers, double elapsed) {
+    long completed = cfg.trials - all.deadlocks;
+    cout << "Trials: " << cfg.trials << " on " << workers << " threads in " << elapsed << " s" << endl;
+    cout << "Readers: " << cfg.readers << ", Writers: " << cfg.writers << ", Reader limit: " << cfg.reader_limit << endl;
+    cout << "Seed: " << seed << endl;
+    cout << "Trials with PANIC: " << all.panic_trials << " (total panics: " << all.total_panics << ")" << endl;
+    if (all.panic_trials > 0) cout << "  first: rerun with --seed " << seed << " --trial " << all.first_panic << endl;
+    cout << "Deadlocked trials: " << all.deadlocks << endl;
+    if (all.deadlocks > 0) cout << "  first: rerun with --seed " << seed << " --trial " << all.first_deadlock << endl;
+    if (completed > 0) {
+        cout << "Steps to completion: mean " << (double) all.total_steps / completed
+             << ", min " << all.min_steps << ", max " << all.max_steps << endl;
+    }
+    cout << "Scheduler picks per trial: mean " << (double) all.total_dispatches / cfg.trials
+         << (cfg.run_to_block ? " (run-to-block)" : "") << endl;
+    cout << "Blocks per trial: mean " << (double) all.total_blocks / cfg.trials << endl;
+    if (cfg.clock && completed > 0) {
+        cout << "Virtual time to completion: mean " << (double) all.total_time / completed << ", max " << all.max_time
+             << endl;
+        cout << "Throughput: " << 1000.0 * completed * (cfg.readers + cfg.writers) / max(all.total_time, 1L)
+             << " processes finished per 1000 time units" << endl;
+    }
+    if (cfg.protocol && cfg.protocol->timed_waits) {
+        cout << "Timed-out waits per trial: mean " << (double) all.total_timeouts / cfg.trials << endl;
+    }
+}
+
+// Run cfg.trials independent trials across the work-stealing pool into all
+// and metrics; returns the number of workers. Trial t uses RNG stream
+// (seed, t), so the totals do not depend on which worker ran it.
+int run_trials(const Config &cfg, uint64_t seed, BatchTotals &all, Metrics &metrics) {
+    int semaphores = (int) semaphore_names(cfg).size();
+    int workers = omp_get_max_threads();
+    TrialPool pool(cfg.trials, workers);
+    vector<BatchTotals> worker_totals(workers);
+    vector<Metrics> worker_metrics(workers, Metrics(semaphores));
+
+    #pragma omp parallel num_threads(workers)
+    {
+        int w = omp_get_thread_num();
+        BatchTotals &totals = worker_totals[w];
+        Simulation sim; // one per worker, reset for each of its trials
+        sim.metrics = &worker_metrics[w];
+        EventQueue events;
+        TimerWheel timers;
+        if (cfg.clock) {
+            sim.events = &events;
+            sim.timers = &timers;
+            sim.durations = &cfg.durations;
+        }
+
+        pool.run(w, [&](long first, long last) {
+            for (long t = first; t < last; t++) {
+                reset_simulation(sim, cfg);
+                seed_trial(sim, seed, t);
+                totals.add(t, cfg.clock ? run_clocked(sim) : run_simulation(sim));
+            }
+        });
+    }
+    for (int w = 0; w < workers; w++) {
+        all.merge(worker_totals[w]);
+        metrics.merge(worker_metrics[w]);
+    }
+    return workers;
+}
+
+// Run cfg.trials trials and print aggregate statistics.
+void run_batch(const Config &cfg, uint64_t seed) {
+    vector<string> sem_names = semaphore_names(cfg);
+    BatchTotals all;
+    Metrics metrics((int) sem_names.size());
+    double start = omp_get_wtime();
+    int workers = run_trials(cfg, seed, all, metrics);
+    double elapsed = omp_get_wtime() - start;
+    print_batch(cfg, seed, all, workers, elapsed);
+    print_metrics(metrics, sem_names, cfg.clock ? "virtual time units" : "scheduler steps");
+}
+
+///// ---  LOCKSTEP LANES START --- /////
+
+// --lanes: batches of the built-in programs on tiny populations (the six-process
+// scenario), LANES independent trials at a time. Every field is an array over
+// lanes, and one lane_step advances all lanes by one scheduler step in a single
+// '#pragma omp simd' loop: each lane draws its own pick, looks its instruction
+// up in a packed copy of the programs, and applies it with selects instead of
+// branches, so lanes running different instructions share the vector ops.
+// Lanes that finish start their next trial; a lane with no trial left is
+// masked out. Picks come from a per-lane copy of the READY set in ReadySet
+// order, so trial t makes exactly the scalar engine's choices and the totals
+// match a scalar batch; only the wait metrics are not collected.
+const int LANES = 16;
+
+// lane_step is also built for AVX2 (variable shifts, 8 ints per op) and picked at load time.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LANE_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_TARGET_CLONES
+#endif
+const int LANE_MAX_PROCESSES = 8; // a whole wait queue fits one uint32_t, 4 bits per pid
+const int LANE_PC_STRIDE = 16;    // program counters per program in LANE_CODE
+
+static_assert(size(READER_PROGRAM) <= LANE_PC_STRIDE && size(WRITER_PROGRAM) <= LANE_PC_STRIDE);
+
+// [type * LANE_PC_STRIDE + pc]: op | sem << 8 | (uint8_t) when << 16 | role << 24.
+constexpr array<int32_t, 2 * LANE_PC_STRIDE> make_lane_code() {
+    array<int32_t, 2 * LANE_PC_STRIDE> code{};
+    for (int type : {READER, WRITER}) {
+        size_t length = type == READER ? size(READER_PROGRAM) : size(WRITER_PROGRAM);
+        for (size_t pc = 0; pc < length; pc++) {
+            const Instruction &ins = PROGRAMS[type][pc];
+            code[type * LANE_PC_STRIDE + pc] = ins.op | ins.sem << 8 | (uint8_t) ins.when << 16 | ins.var << 24;
+        }
+    }
+    return code;
+}
+
+constexpr array<int32_t, 2 * LANE_PC_STRIDE> LANE_CODE = make_lane_code();
+
+struct alignas(64) LaneBatch {
+    int32_t pc[LANE_MAX_PROCESSES][LANES];
+    int32_t ready[LANE_MAX_PROCESSES][LANES]; // READY pids, in ReadySet::pids order
+    int32_t ready_size[LANES];
+    int32_t value[SEM_BUILTIN_COUNT][LANES];
+    uint32_t queue[SEM_BUILTIN_COUNT][LANES]; // FIFO of BLOCKED pids, head in the low bits
+    int32_t queued[SEM_BUILTIN_COUNT][LANES];
+    int32_t read_count[LANES];
+    int32_t active_readers[LANES];
+    int32_t active_writers[LANES];
+    int32_t violated[LANES];  // built-in invariants currently broken, one bit each
+    int32_t remaining[LANES]; // processes not FINISHED yet
+    int32_t live[LANES];      // 1 while the lane runs a trial
+    int32_t panics[LANES];
+    int32_t steps[LANES];     // a trial of LANE_MAX_PROCESSES takes ~100 steps
+    int32_t blocks[LANES];
+    int64_t trial[LANES];
+    uint64_t rng[4][LANES];   // Xoshiro256 words
+};
+
+// Put trial t on lane l, in the state reset_simulation would leave it in.
+void lane_start(LaneBatch &b, int l, const Config &cfg, uint64_t seed, long t) {
+    int total = cfg.readers + cfg.writers;
+    for (int k = 0; k < LANE_MAX_PROCESSES; k++) {
+        b.pc[k][l] = 0;
+        b.ready[k][l] = k;
+    }
+    b.ready_size[l] = total;
+    b.value[SEM_READ_COUNT_LOCK][l] = 1;
+    b.value[SEM_WRT][l] = 1;
+    b.value[SEM_READER_LIMITER][l] = cfg.reader_limit;
+    for (int id = 0; id < SEM_BUILTIN_COUNT; id++) {
+        b.queue[id][l] = 0;
+        b.queued[id][l] = 0;
+    }
+    b.read_count[l] = b.active_readers[l] = b.active_writers[l] = b.violated[l] = 0;
+    b.remaining[l] = total;
+    b.live[l] = 1;
+    b.panics[l] = 0;
+    b.steps[l] = b.blocks[l] = 0;
+    b.trial[l] = t;
+    SimRng rng;
+    rng.seed(seed, t);
+    for (int i = 0; i < 4; i++) b.rng[i][l] = rng.s[i];
+}
+
+// All ones if flag, else 0: x & lane_mask(flag) is the branch-free select.
+inline int lane_mask(int flag) { return flag ? -1 : 0; }
+
+// One scheduler step on every live lane: step_process for a pick drawn as
+// run_simulation draws it.
+LANE_TARGET_CLONES
+void lane_step(LaneBatch &b, int readers, int reader_limit) {
+    // Flags are 0/1 ints, and every select is written as masking (x & -flag)
+    // so the compiler keeps the body branch-free and vectorizes across lanes.
+    // Xoshiro256::next and below(ready_size), kept apart from the 32-bit step below
+    int32_t slots[LANES];
+    #pragma omp simd
+    for (int l = 0; l < LANES; l++) {
+        uint64_t s0 = b.rng[0][l], s1 = b.rng[1][l], s2 = b.rng[2][l], s3 = b.rng[3][l];
+        uint64_t x = Xoshiro256::rotl(s1 * 5, 7) * 9;
+        uint64_t t = s1 << 17;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = Xoshiro256::rotl(s3, 45);
+        b.rng[0][l] = s0;
+        b.rng[1][l] = s1;
+        b.rng[2][l] = s2;
+        b.rng[3][l] = s3;
+        slots[l] = (int32_t) (((x >> 32) * (uint64_t) (uint32_t) b.ready_size[l]) >> 32);
+    }
+
+    #pragma omp simd
+    for (int l = 0; l < LANES; l++) {
+        int go = b.live[l] & (b.ready_size[l] > 0); // an empty population takes no step
+        int size = b.ready_size[l];
+        int slot = slots[l];
+
+        int pid = 0, last = 0, pc = 0;
+        #pragma GCC unroll 8
+        for (int k = 0; k < LANE_MAX_PROCESSES; k++) {
+            pid |= b.ready[k][l] & lane_mask(k == slot);
+            last |= b.ready[k][l] & lane_mask(k == size - 1);
+        }
+        #pragma GCC unroll 8
+        for (int k = 0; k < LANE_MAX_PROCESSES; k++) pc |= b.pc[k][l] & lane_mask(k == pid);
+        int code = LANE_CODE[(pid >= readers) * LANE_PC_STRIDE + pc];
+        int op = code & 0xFF, sem = (code >> 8) & 0xFF, when = (((code >> 16) & 0xFF) ^ 0x80) - 0x80, role = code >> 24;
+
+        int value = 0, queued = 0;
+        uint32_t queue = 0;
+        #pragma GCC unroll 8
+        for (int id = 0; id < SEM_BUILTIN_COUNT; id++) {
+            int mask = lane_mask(id == sem);
+            value |= b.value[id][l] & mask;
+            queue |= b.queue[id][l] & mask;
+            queued |= b.queued[id][l] & mask;
+        }
+        int conditional = (op == OP_WAIT_IF) | (op == OP_SIGNAL_IF);
+        int condition = (conditional ^ 1) | (b.read_count[l] == when);
+        int wait = go & ((op == OP_WAIT) | (op == OP_WAIT_IF)) & condition;
+        int signal = go & ((((op == OP_SIGNAL) | (op == OP_SIGNAL_IF)) & condition) | ((op == OP_EXIT_CS) & (sem != SEM_NONE)));
+        int new_value = value + signal - wait;
+        int block = wait & (new_value < 0);
+        int wake = signal & (new_value <= 0) & (queued > 0);
+        int woken = queue & 0xF;
+        uint32_t tail = 0; // 16^queued: a variable shift per lane needs AVX2, a select does not
+        #pragma GCC unroll 8
+        for (int k = 0; k < LANE_MAX_PROCESSES; k++) tail |= (1u << 4 * k) & lane_mask(k == queued);
+        uint32_t new_queue = ((queue | (uint32_t) pid * tail) & lane_mask(block)) | ((queue >> 4) & lane_mask(wake))
+                           | (queue & lane_mask((block | wake) ^ 1));
+        int new_queued = queued + block - wake;
+        #pragma GCC unroll 8
+        for (int id = 0; id < SEM_BUILTIN_COUNT; id++) {
+            int mask = lane_mask(id == sem);
+            b.value[id][l] += (new_value - value) & mask;
+            b.queue[id][l] ^= (new_queue ^ queue) & mask;
+            b.queued[id][l] += (new_queued - queued) & mask;
+        }
+
+        int finish = go & (op == OP_FINISH);
+        int enter = go & (op == OP_ENTER_CS), exit = go & (op == OP_EXIT_CS);
+        int reader = role == READER;
+        b.read_count[l] += (go & (op == OP_INC_SHARED)) - (go & (op == OP_DEC_SHARED));
+        b.active_readers[l] += (enter - exit) & lane_mask(reader);
+        b.active_writers[l] += (enter - exit) & lane_mask(reader ^ 1);
+
+        // pid moves on unless it BLOCKED or finished; a woken process moves past its SemWait.
+        int advance = go & (block ^ 1) & (finish ^ 1);
+        #pragma GCC unroll 8
+        for (int k = 0; k < LANE_MAX_PROCESSES; k++) b.pc[k][l] += ((k == pid) & advance) + ((k == woken) & wake);
+
+        // READY set: ready_remove(pid) swaps the last pid into its slot, ready_add(woken) appends.
+        int leave = block | finish;
+        size -= leave;
+        #pragma GCC unroll 8
+        for (int k = 0; k < LANE_MAX_PROCESSES; k++) {
+            int ready = b.ready[k][l];
+            int mask_leave = lane_mask(leave & (k == slot)), mask_wake = lane_mask(wake & (k == size));
+            ready = (ready & ~mask_leave) | (last & mask_leave);
+            b.ready[k][l] = (ready & ~mask_wake) | (woken & mask_wake);
+        }
+        b.ready_size[l] = size + wake;
+        b.remaining[l] -= finish;
+
+        // check_invariants over the built-in invariants, in BUILTIN_INVARIANTS order
+        int readers_in = b.active_readers[l], writers_in = b.active_writers[l];
+        int violated = (writers_in > 1) | ((writers_in > 0) & (readers_in > 0)) << 1 | (readers_in > reader_limit) << 2;
+        int fresh = violated & ~b.violated[l];
+        b.panics[l] += (fresh & 1) + ((fresh >> 1) & 1) + (fresh >> 2);
+        b.violated[l] = violated;
+        b.steps[l] += go;
+        b.blocks[l] += block;
+    }
+}
+
+// Worker w's share of a lane batch: keep every lane busy with trials from the
+// pool until it runs dry, adding each finished trial to totals.
+void run_lane_worker(TrialPool &pool, int w, const Config &cfg, uint64_t seed, BatchTotals &totals) {
+    LaneBatch b{}; // lanes left idle still get stepped (masked), so start them in a valid state
+    long next = 0, last = 0; // trials of the chunk being handed out to lanes
+    int running = 0;
+    for (int l = 0; l < LANES; l++) {
+        if (next == last && !pool.next(w, next, last)) {
+            b.live[l] = 0;
+            continue;
+        }
+        lane_start(b, l, cfg, seed, next++);
+        running++;
+    }
+    while (running > 0) {
+        lane_step(b, cfg.readers, cfg.reader_limit);
+        for (int l = 0; l < LANES; l++) {
+            // Done, or deadlocked as run_simulation would find it before its next pick
+            if (!b.live[l] || (b.remaining[l] > 0 && b.ready_size[l] > 0)) continue;
+            totals.add(b.trial[l], {b.steps[l], b.steps[l], b.blocks[l], b.panics[l], b.remaining[l] > 0});
+            if (next == last && !pool.next(w, next, last)) {
+                b.live[l] = 0;
+                running--;
+                continue;
+            }
+            lane_start(b, l, cfg, seed, next++);
+        }
+    }
+}
+
+// Lane flavour of run_batch for the built-in programs without run-to-block.
+void run_lanes(const Config &cfg, uint64_t seed) {
+    int workers = omp_get_max_threads();
+    TrialPool pool(cfg.trials, workers);
+    vector<BatchTotals> worker_totals(workers);
+
+    double start = omp_get_wtime();
+    #pragma omp parallel num_threads(workers)
+    {
+        int w = omp_get_thread_num();
+        run_lane_worker(pool, w, cfg, seed, worker_totals[w]);
+    }
+    BatchTotals all;
+    for (const BatchTotals &totals : worker_totals) all.merge(totals);
+    double elapsed = omp_get_wtime() - start;
+    print_batch(cfg, seed, all, workers, elapsed);
+    cout << "(" << LANES << " lanes per thread; wait metrics are not collected in --lanes mode)" << endl;
+}
+
+///// ---  LOCKSTEP LANES END ----- /////
+
+///// ---  PARAMETER SWEEP START --- /////
+
+const long SWEEP_DEFAULT_TRIALS = 1000;
+const long SWEEP_CHUNK = 64; // trials per work item, so one big configuration still spreads over all threads
+
+// Trials of one grid point, reduced.
+struct SweepPoint {
+    Config cfg;
+    long deadlocks = 0;
+    long panic_trials = 0;
+    Histogram completion; // steps to DONE, one per trial that did not deadlock
+    uint64_t max_writer_wait = 0; // steps from a writer's first SemWait to its CS entry
+};
+
+// Every combination of the --axis values, readers varying slowest.
+vector<SweepPoint> sweep_points(const Config &cfg) {
+    vector<int> readers = cfg.sweep_readers.empty() ? vector<int>{cfg.readers} : cfg.sweep_readers;
+    vector<int> writers = cfg.sweep_writers.empty() ? vector<int>{cfg.writers} : cfg.sweep_writers;
+    vector<int> limits = cfg.sweep_limits.empty() ? vector<int>{cfg.reader_limit} : cfg.sweep_limits;
+    vector<bool> policies = cfg.sweep_run_to_block.empty() ? vector<bool>{cfg.run_to_block} : cfg.sweep_run_to_block;
+    vector<SweepPoint> points;
+    for (int r : readers) {
+        for (int w : writers) {
+            for (int limit : limits) {
+                for (bool run_to_block : policies) {
+                    SweepPoint point;
+                    point.cfg = cfg;
+                    point.cfg.readers = r;
+                    point.cfg.writers = w;
+                    point.cfg.reader_limit = limit;
+                    point.cfg.run_to_block = run_to_block;
+                    points.push_back(point);
+                }
+            }
+        }
+    }
+    return points;
+}
+
+void write_sweep_csv(const vector<SweepPoint> &points, long trials, ostream &out) {
+    out << "readers,writers,limit,policy,trials,mean_completion_steps,p50_completion_steps,p99_completion_steps,"
+           "panic_rate,deadlock_rate,max_writer_wait\n";
+    for (const SweepPoint &p : points) {
+        const Histogram &c = p.completion;
+        out << p.cfg.readers << "," << p.cfg.writers << "," << p.cfg.reader_limit << ","
+            << (p.cfg.run_to_block ? "run-to-block" : "random") << "," << trials << ",";
+        if (c.total > 0) {
+            out << (double) c.sum / c.total << "," << c.percentile(0.5) << "," << c.percentile(0.99);
+        } else {
+            out << ",,";
+        }
+        out << "," << (double) p.panic_trials / trials << "," << (double) p.deadlocks / trials << ","
+            << p.max_writer_wait << "\n";
+    }
+}
+
+void write_sweep_json(const vector<SweepPoint> &points, long trials, uint64_t seed, ostream &out) {
+    out << "{\n  \"seed\": " << seed << ",\n  \"rows\": [\n";
+    for (size_t i = 0; i < points.size(); i++) {
+        const SweepPoint &p = points[i];
+        out << "    {\"readers\": " << p.cfg.readers << ", \"writers\": " << p.cfg.writers
+            << ", \"limit\": " << p.cfg.reader_limit
+            << ", \"policy\": \"" << (p.cfg.run_to_block ? "run-to-block" : "random") << "\""
+            << ", \"trials\": " << trials;
+        const Histogram &c = p.completion;
+        if (c.total > 0) {
+            out << ", \"mean_completion_steps\": " << (double) c.sum / c.total
+                << ", \"p50_completion_steps\": " << c.percentile(0.5)
+                << ", \"p99_completion_steps\": " << c.percentile(0.99);
+        } else {
+            out << ", \"mean_completion_steps\": null, \"p50_completion_steps\": null, \"p99_completion_steps\": null";
+        }
+        out << ", \"panic_rate\": " << (double) p.panic_trials / trials
+            << ", \"deadlock_rate\": " << (double) p.deadlocks / trials
+            << ", \"max_writer_wait\": " << p.max_writer_wait << "}"
+            << (i + 1 < points.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// One batch per grid point, all of them sharing the thread pool: work items
+// are chunks of one point's trials. Trial t runs on stream (seed, t) at every
+// point, so rows differ by configuration rather than by luck, and any trial
+// can be rerun alone with the row's options and --seed/--trial.
+void run_sweep(const Config &cfg, uint64_t seed) {
+    long trials = cfg.trials > 0 ? cfg.trials : SWEEP_DEFAULT_TRIALS;
+    vector<SweepPoint> points = sweep_points(cfg);
+    long chunks = (trials + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    int semaphores = (int) semaphore_names(cfg).size();
+
+    double start = omp_get_wtime();
+    #pragma omp parallel
+    {
+        Simulation sim;
+        Metrics local(semaphores); // only the writers' PM_TIME_TO_CS is read
+        sim.metrics = &local;
+
+        #pragma omp for schedule(dynamic)
+        for (long item = 0; item < (long) points.size() * chunks; item++) {
+            SweepPoint &point = points[item / chunks];
+            long first = item % chunks * SWEEP_CHUNK, last = min(first + SWEEP_CHUNK, trials);
+            long deadlocks = 0, panic_trials = 0;
+            Histogram completion;
+            for (Histogram &h : local.process[WRITER]) h = Histogram();
+            for (long t = first; t < last; t++) {
+                reset_simulation(sim, point.cfg);
+                seed_trial(sim, seed, t);
+                TrialResult r = run_simulation(sim);
+                if (r.panics > 0) panic_trials++;
+                if (r.deadlocked) deadlocks++;
+                else completion.record(r.steps);
+            }
+
+            #pragma omp critical
+            {
+                point.completion.merge(completion);
+                point.deadlocks += deadlocks;
+                point.panic_trials += panic_trials;
+                point.max_writer_wait = max(point.max_writer_wait, local.process[WRITER][PM_TIME_TO_CS].max);
+            }
+        }
+    }
+    double elapsed = omp_get_wtime() - start;
+
+    if (cfg.sweep == "json") write_sweep_json(points, trials, seed, cout);
+    else write_sweep_csv(points, trials, cout);
+    cerr << "Swept " << points.size() << " configurations x " << trials << " trials on " << omp_get_max_threads()
+         << " threads in " << elapsed << " s (seed " << seed << ")" << endl;
+}
+
+// "name=v1,v2,...": values of one grid axis (readers, writers, limit or policy).
+bool parse_axis(const string &value, Config &cfg) {
+    size_t eq = value.find('=');
+    if (eq == string::npos) return false;
+    string name = value.substr(0, eq);
+    stringstream values(value.substr(eq + 1));
+    vector<int> *axis = name == "readers" ? &cfg.sweep_readers
+                      : name == "writers" ? &cfg.sweep_writers
+                      : name == "limit" ? &cfg.sweep_limits : nullptr;
+    if (!axis && name != "policy") return false;
+    for (string item; getline(values, item, ',');) {
+        if (!axis) {
+            if (item != "random" && item != "run-to-block") return false;
+            cfg.sweep_run_to_block.push_back(item == "run-to-block");
+            continue;
+        }
+        long n;
+        bool limit = axis == &cfg.sweep_limits;
+        if (!parse_number(item, limit ? 1 : 0, limit ? INT_MAX : MAX_PROCESSES, n)) return false;
+        axis->push_back((int) n);
+    }
+    return true;
+}
+
+///// ---  PARAMETER SWEEP END ----- /////
+
+///// ---  WAKE POLICIES START --- /////
+
+// Apply cfg.wake ("SEM=POLICY" or "all=POLICY", later ones winning) to
+// cfg.wake_policy. Protocol semaphores have names only once it is loaded.
+bool resolve_wake(Config &cfg, string &error) {
+    vector<string> names = semaphore_names(cfg);
+    for (const string &spec : cfg.wake) {
+        size_t eq = spec.find('=');
+        string sem = spec.substr(0, eq), policy = eq == string::npos ? "" : spec.substr(eq + 1);
+        auto it = find(begin(WAKE_POLICY_NAMES), end(WAKE_POLICY_NAMES), policy);
+        if (it == end(WAKE_POLICY_NAMES)) {
+            error = "expected SEM=fifo|lifo|writers-first|random, got '" + spec + "'";
+            return false;
+        }
+        int id = find_name(names, sem);
+        if (id < 0 && sem != "all") {
+            error = "unknown semaphore '" + sem + "'";
+            return false;
+        }
+        for (int s = 0; s < (int) names.size(); s++) {
+            if (sem == "all" || s == id) cfg.wake_policy[s] = (WakePolicy) (it - begin(WAKE_POLICY_NAMES));
+        }
+    }
+    return true;
+}
+
+// --compare-wake: the same trials (same seeds) once per wake policy on wrt and
+// reader_limiter, then how long their waiters waited under each.
+void run_wake_comparison(const Config &cfg, uint64_t seed) {
+    Config run = cfg;
+    if (run.trials == 0) run.trials = SWEEP_DEFAULT_TRIALS;
+    int semaphores = (int) semaphore_names(cfg).size();
+    cout << "Readers: " << run.readers << ", Writers: " << run.writers << ", Reader limit: " << run.reader_limit
+         << ", " << run.trials << " trials per policy, seed " << seed << endl;
+    cout << "Wait before being woken, in " << (cfg.clock ? "virtual time units" : "scheduler steps")
+         << " (percentiles within 1/16):" << endl;
+    cout << "  " << left << setw(16) << "policy" << setw(18) << "semaphore" << right << setw(10) << "waits"
+         << setw(10) << "mean" << setw(8) << "p50" << setw(8) << "p99" << setw(8) << "max" << endl;
+
+    double start = omp_get_wtime();
+    for (int policy = 0; policy < WAKE_POLICY_COUNT; policy++) {
+        run.wake_policy[SEM_WRT] = run.wake_policy[SEM_READER_LIMITER] = (WakePolicy) policy;
+        BatchTotals all;
+        Metrics metrics(semaphores);
+        run_trials(run, seed, all, metrics);
+        for (int id : {SEM_WRT, SEM_READER_LIMITER}) {
+            const Histogram &h = metrics.sem_wait[id];
+            cout << "  " << left << setw(16) << WAKE_POLICY_NAMES[policy] << setw(18) << SEM_NAMES[id] << right
+                 << setw(10) << h.total << setw(10) << fixed << setprecision(2)
+                 << (h.total ? (double) h.sum / h.total : 0.0) << defaultfloat << setprecision(6)
+                 << setw(8) << h.percentile(0.50) << setw(8) << h.percentile(0.99) << setw(8) << h.max << endl;
+        }
+        if (all.deadlocks > 0) cout << "  " << WAKE_POLICY_NAMES[policy] << ": " << all.deadlocks << " deadlocked trials" << endl;
+    }
+    cerr << "Compared " << (int) WAKE_POLICY_COUNT << " policies x " << run.trials << " trials on " << omp_get_max_threads()
+         << " threads in " << omp_get_wtime() - start << " s" << endl;
+}
+
+///// ---  WAKE POLICIES END ----- /////
+
+///// ---  SCHEDULE REPLAY START --- /////
+
+// A recorded schedule file: this header, then ScheduleLog bytes. The header
+// carries everything needed to rebuild the run except the protocol file,
+// which must be passed again (its semaphore count is checked).
+const char SCHEDULE_MAGIC[4] = {'P', '3', 'S', 'C'};
+const uint32_t SCHEDULE_VERSION = 1;
+
+struct ScheduleHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t readers;
+    int32_t writers;
+    int32_t reader_limit;
+    uint8_t run_to_block;
+    uint8_t coroutines;
+    uint16_t semaphores;
+    uint64_t seed;
+    int64_t trial;
+    int64_t picks;
+    uint64_t bytes;
+};
+static_assert(sizeof(ScheduleHeader) == 56, "schedule headers are written as raw bytes");
+
+struct ScheduleFile {
+    ScheduleHeader header;
+    vector<uint8_t> bytes;
+    long replayed = 0;   // picks dispatched so far
+    bool stopped = false; // replay halted at --stop-at
+    string error;        // set if the schedule does not fit the run
+};
+
+bool save_schedule(const string &path, const Config &cfg, uint64_t seed, const ScheduleLog &log) {
+    ScheduleHeader header{};
+    memcpy(header.magic, SCHEDULE_MAGIC, 4);
+    header.version = SCHEDULE_VERSION;
+    header.readers = cfg.readers;
+    header.writers = cfg.writers;
+    header.reader_limit = cfg.reader_limit;
+    header.run_to_block = cfg.run_to_block;
+    header.coroutines = cfg.coroutines;
+    header.semaphores = (uint16_t) semaphore_names(cfg).size();
+    header.seed = seed;
+    header.trial = cfg.trial;
+    header.picks = log.picks;
+    header.bytes = log.bytes.size();
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+              && fwrite(log.bytes.data(), 1, log.bytes.size(), out) == log.bytes.size();
+    return fclose(out) == 0 && ok;
+}
+
+// Check the header fields load_schedule sizes and configures the run from;
+// payload is the file size past the header. False (and why in error) if one is off.
+bool check_schedule(const ScheduleHeader &header, long payload, string &error) {
+    auto bad = [&](const string &what) {
+        error = what;
+        return false;
+    };
+    if (header.readers < 0 || header.writers < 0 || header.readers > MAX_PROCESSES || header.writers > MAX_PROCESSES
+        || header.readers + header.writers > MAX_PROCESSES) {
+        return bad("population out of range");
+    }
+    if (header.reader_limit < 1) return bad("reader limit out of range");
+    if (header.run_to_block > 1 || header.coroutines > 1) return bad("bad header flags");
+    if (header.trial < 0 || header.picks < 0) return bad("negative trial or pick count");
+    if (header.bytes > (uint64_t) payload) return bad("truncated: " + to_string(header.bytes) + " bytes of picks promised");
+    return true;
+}
+
+// Read path into file and set cfg up to rebuild the recorded run.
+bool load_schedule(const string &path, Config &cfg, ScheduleFile &file, string &error) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    ScheduleHeader &header = file.header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1 && memcmp(header.magic, SCHEDULE_MAGIC, 4) == 0
+              && header.version == SCHEDULE_VERSION;
+    long payload = ok && fseek(in, 0, SEEK_END) == 0 ? ftell(in) - (long) sizeof(header) : -1;
+    if (ok && (payload < 0 || fseek(in, sizeof(header), SEEK_SET) != 0)) ok = false;
+    if (ok && !check_schedule(header, payload, error)) {
+        fclose(in);
+        error = path + ": " + error;
+        return false;
+    }
+    if (ok) {
+        file.bytes.resize(header.bytes);
+        ok = fread(file.bytes.data(), 1, file.bytes.size(), in) == file.bytes.size();
+    }
+    fclose(in);
+    if (!ok) {
+        error = path + " is not a version " + to_string(SCHEDULE_VERSION) + " schedule";
+        return false;
+    }
+    cfg.readers = header.readers;
+    cfg.writers = header.writers;
+    cfg.reader_limit = header.reader_limit;
+    cfg.run_to_block = header.run_to_block;
+    cfg.coroutines = header.coroutines;
+    cfg.trial = header.trial;
+    if (header.semaphores != semaphore_names(cfg).size()) {
+        error = path + " was recorded with " + to_string(header.semaphores) + " semaphores; pass the same --protocol";
+        return false;
+    }
+    return true;
+}
+
+// run_simulation with the picks taken from file instead of the RNG. Stops
+// before the first pick at or past step stop_at (-1 = never).
+TrialResult replay_schedule(Simulation &sim, ScheduleFile &file, long stop_at) {
+    int total = sim.processes.size();
+    int completed = 0;
+    bool deadlocked = false;
+    size_t at = 0;
+    int pid = 0;
+    for (file.replayed = 0; file.replayed < file.header.picks; file.replayed++) {
+        if (stop_at >= 0 && sim.steps >= stop_at) {
+            file.stopped = true;
+            break;
+        }
+
+        // At most 5 bytes (32 bits), the last carrying only the top 4.
+        uint32_t zigzag = 0;
+        uint8_t byte = 0x80;
+        int length = 0;
+        for (int shift = 0; (byte & 0x80) && length < 5 && at < file.bytes.size(); shift += 7, length++) {
+            byte = file.bytes[at++];
+            zigzag |= (uint32_t) (byte & 0x7F) << shift;
+        }
+        if ((byte & 0x80) || (length == 5 && byte > 0x0F)) {
+            file.error = "pick " + to_string(file.replayed) + " is not a well-formed varint";
+            break;
+        }
+        long next = pid + (long) ((int32_t) (zigzag >> 1) ^ -(int32_t) (zigzag & 1));
+        if (next < 0 || next >= total || sim.processes.status[next] != READY) {
+            file.error = "pick " + to_string(file.replayed) + " chooses process " + to_string(next)
+                       + ", which is not READY; the schedule belongs to a different run";
+            break;
+        }
+        pid = (int) next;
+        dispatch_process(sim, pid);
+        if (sim.processes.status[pid] == FINISHED) completed++;
+    }
+    // A deadlock ends the recorded run, so it can only follow the last pick.
+    if (!file.stopped && file.error.empty() && completed < total) deadlocked = check_deadlock(sim, total - completed);
+    return {sim.steps, sim.dispatches, sim.blocks, sim.panics, deadlocked};
+}
+
+// The instruction as a protocol file line.
+string describe_instruction(const Instruction &ins, const vector<string> &sem_names, const vector<string> &shared_names) {
+    string sem = ins.sem == SEM_NONE ? "" : sem_names[ins.sem];
+    string role = ins.var == READER ? "reader" : "writer";
+    switch (ins.op) {
+        case OP_WAIT: return "wait " + sem;
+        case OP_SIGNAL: return "signal " + sem;
+        case OP_WAIT_IF: return "wait_if " + sem + " " + shared_names[ins.var] + " " + to_string(ins.when);
+        case OP_SIGNAL_IF: return "signal_if " + sem + " " + shared_names[ins.var] + " " + to_string(ins.when);
+        case OP_INC_SHARED: return "inc " + shared_names[ins.var];
+        case OP_DEC_SHARED: return "dec " + shared_names[ins.var];
+        case OP_ENTER_CS: return "enter_cs " + role;
+        case OP_EXIT_CS: return "exit_cs " + role + (sem.empty() ? "" : " " + sem);
+        case OP_BUSY: return "busy";
+        case OP_WAIT_TIMED:
+            return "wait_timed " + sem + " " + (ins.timeout == TIMEOUT_OPTION ? "timeout" : to_string(ins.timeout))
+                 + " (then pc " + to_string(ins.target) + ")";
+        default: return "finish";
+    }
+}
+
+// Dump sim for inspection: counters, shared variables, semaphores with their
+// wait queues, and what every live process does next.
+void print_state(const Simulation &sim, const Config &cfg) {
+    vector<string> sem_names = semaphore_names(cfg);
+    vector<string> shared_names = cfg.protocol ? cfg.protocol->shared_names : vector<string>{"read_count"};
+    cout << "Readers in CS: " << sim.active_readers << ", Writers in CS: " << sim.active_writers << endl;
+    for (size_t v = 0; v < shared_names.size(); v++) cout << shared_names[v] << " = " << shared_var(sim, v) << endl;
+    for (size_t id = 0; id < sem_names.size(); id++) {
+        const SimSemaphore &sem = semaphore(sim, id);
+        cout << "Semaphore " << sem_names[id] << ": value " << sem.value << ", waiting:";
+        for (int pid = sem.wait_queue.head; pid != -1; pid = sim.processes.wait_next[pid]) cout << " " << pid;
+        cout << endl;
+    }
+    const char *const STATUS_NAMES[] = {"READY", "BLOCKED", "FINISHED"};
+    for (int pid = 0; pid < sim.processes.size(); pid++) {
+        if (sim.processes.status[pid] == FINISHED) continue;
+        cout << "Process " << pid << " (" << (sim.processes.type[pid] == READER ? "reader" : "writer") << ") "
+             << STATUS_NAMES[sim.processes.status[pid]] << " at pc " << sim.processes.program_counter[pid]
+             << ": " << describe_instruction(next_instruction(sim, pid), sem_names, shared_names) << endl;
+    }
+}
+
+///// ---  SCHEDULE REPLAY END ----- /////
+
+///// ---  SNAPSHOT START --- /////
+
+// A snapshot file: this header, then the semaphores (value and wait queue),
+// the shared variables, the process table columns, the READY set's pid order
+// (the next pick depends on it) and, if metrics were on, the WaitStats
+// columns, each written raw. The wait-for graph is rebuilt on restore.
+const char SNAPSHOT_MAGIC[4] = {'P', '3', 'S', 'N'};
+const uint32_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t readers;
+    int32_t writers;
+    int32_t reader_limit;
+    uint8_t run_to_block;
+    uint8_t metrics;
+    uint16_t semaphores;
+    uint16_t shared;
+    uint16_t unused;
+    int32_t panics;
+    uint64_t seed;
+    int64_t trial;
+    int64_t steps;
+    int64_t dispatches;
+    int64_t blocks;
+    uint64_t rng[4];
+    uint64_t dirty;
+    uint64_t violated;
+    int32_t active_readers;
+    int32_t active_writers;
+};
+static_assert(sizeof(SnapshotHeader) == 128, "snapshot headers are written as raw bytes");
+static_assert(sizeof(long) == sizeof(int64_t), "WaitStats columns are written as raw int64s");
+
+struct SnapshotSemaphore {
+    int32_t value;
+    int32_t head;
+    int32_t tail;
+    int32_t size;
+};
+
+// A loaded snapshot, mapped read-only until it goes out of scope.
+struct SnapshotFile {
+    SnapshotHeader header{};
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    SnapshotFile() = default;
+    SnapshotFile(const SnapshotFile &) = delete;
+    SnapshotFile &operator=(const SnapshotFile &) = delete;
+    ~SnapshotFile() {
+        if (data) munmap((void *) data, size);
+    }
+};
+
+size_t snapshot_bytes(const SnapshotHeader &header) {
+    size_t total = header.readers + header.writers;
+    size_t bytes = sizeof(SnapshotHeader) + header.semaphores * sizeof(SnapshotSemaphore) + header.shared * sizeof(int32_t)
+                 + total * (3 * sizeof(int32_t) + 3);
+    if (header.metrics) bytes += total * (3 * sizeof(int64_t) + sizeof(int32_t)) + total * header.semaphores * sizeof(int64_t);
+    return bytes;
+}
+
+template <typename T>
+void snapshot_put(vector<uint8_t> &out, const T *values, size_t count) {
+    const uint8_t *bytes = (const uint8_t *) values;
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+void snapshot_get(const uint8_t *&in, T *values, size_t count) {
+    memcpy(values, in, count * sizeof(T));
+    in += count * sizeof(T);
+}
+
+bool save_snapshot(const string &path, const Simulation &sim, const Config &cfg, uint64_t seed) {
+    const ProcessTable &processes = sim.processes;
+    size_t total = processes.size();
+    SnapshotHeader header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.readers = cfg.readers;
+    header.writers = cfg.writers;
+    header.reader_limit = cfg.reader_limit;
+    header.run_to_block = sim.run_to_block;
+    header.metrics = sim.metrics != nullptr;
+    header.semaphores = SEM_BUILTIN_COUNT + sim.extra_semaphores.size();
+    header.shared = 1 + sim.extra_shared.size();
+    header.panics = sim.panics;
+    header.seed = seed;
+    header.trial = cfg.trial;
+    header.steps = sim.steps;
+    header.dispatches = sim.dispatches;
+    header.blocks = sim.blocks;
+    memcpy(header.rng, sim.rng.s, sizeof(header.rng));
+    header.dirty = sim.dirty;
+    header.violated = sim.violated;
+    header.active_readers = sim.active_readers;
+    header.active_writers = sim.active_writers;
+
+    vector<uint8_t> out;
+    out.reserve(snapshot_bytes(header));
+    snapshot_put(out, &header, 1);
+    for (int id = 0; id < header.semaphores; id++) {
+        const SimSemaphore &sem = semaphore(sim, id);
+        SnapshotSemaphore saved = {sem.value, sem.wait_queue.head, sem.wait_queue.tail, sem.wait_queue.size};
+        snapshot_put(out, &saved, 1);
+    }
+    for (int v = 0; v < header.shared; v++) {
+        int32_t value = shared_var(sim, v);
+        snapshot_put(out, &value, 1);
+    }
+    snapshot_put(out, processes.program_counter.data(), total);
+    snapshot_put(out, processes.wait_next.data(), total);
+    snapshot_put(out, processes.status.data(), total);
+    snapshot_put(out, processes.type.data(), total);
+    snapshot_put(out, processes.waiting_on.data(), total);
+    snapshot_put(out, sim.ready_set.pids.data(), total);
+    if (header.metrics) {
+        const WaitStats &stats = sim.wait_stats;
+        snapshot_put(out, stats.first_wait.data(), total);
+        snapshot_put(out, stats.blocked_since.data(), total);
+        snapshot_put(out, stats.blocked_steps.data(), total);
+        snapshot_put(out, stats.blocks.data(), total);
+        snapshot_put(out, stats.held_since.data(), stats.held_since.size());
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && ok;
+}
+
+// Check every index and enum in file against the programs and semaphores of
+// cfg, so restore_snapshot can trust them; false (and why in error) if one is off.
+bool check_snapshot(const SnapshotFile &file, const Config &cfg, string &error) {
+    const SnapshotHeader &header = file.header;
+    int total = header.readers + header.writers;
+    int semaphores = header.semaphores;
+    int shared = cfg.protocol ? (int) cfg.protocol->shared_names.size() : 1;
+    auto bad = [&](const string &what) {
+        error = what;
+        return false;
+    };
+    auto read = [](const uint8_t *column, int i, auto value) {
+        memcpy(&value, column + (size_t) i * sizeof(value), sizeof(value));
+        return value;
+    };
+    if (header.run_to_block > 1 || header.metrics > 1) return bad("bad header flags");
+    if (header.reader_limit < 1) return bad("reader limit out of range");
+    if (header.shared != shared) return bad("saved with " + to_string(header.shared) + " shared variables, expected " + to_string(shared));
+    if (header.active_readers < 0 || header.active_readers > header.readers
+        || header.active_writers < 0 || header.active_writers > header.writers) {
+        return bad("CS counters out of range");
+    }
+
+    const uint8_t *sems = file.data + sizeof(SnapshotHeader);
+    const uint8_t *pcs = sems + semaphores * sizeof(SnapshotSemaphore) + shared * sizeof(int32_t);
+    const uint8_t *next = pcs + (size_t) total * sizeof(int32_t);
+    const uint8_t *status = next + (size_t) total * sizeof(int32_t);
+    const uint8_t *type = status + total;
+    const uint8_t *waiting_on = type + total;
+    const uint8_t *ready = waiting_on + total;
+
+    size_t length[2]; // program length per ProcType
+    for (int t : {READER, WRITER}) {
+        length[t] = cfg.protocol ? cfg.protocol->programs[t].code.size() : t == READER ? size(READER_PROGRAM) : size(WRITER_PROGRAM);
+    }
+    int blocked = 0, ready_count = 0;
+    for (int pid = 0; pid < total; pid++) {
+        auto at = [&](const string &what) { return bad("process " + to_string(pid) + ": " + what); };
+        uint8_t pid_type = type[pid], pid_status = status[pid], sem = waiting_on[pid];
+        if (pid_type != (pid < header.readers ? READER : WRITER)) return at("bad type");
+        if (pid_status > FINISHED) return at("bad status");
+        int32_t pc = read(pcs, pid, int32_t());
+        if (pc < 0 || (size_t) pc >= length[pid_type]) return at("program counter " + to_string(pc) + " out of range");
+        if ((pid_status == BLOCKED) != (sem != SEM_NONE) || (sem != SEM_NONE && sem >= semaphores)) {
+            return at("bad waiting_on");
+        }
+        int32_t link = read(next, pid, int32_t());
+        if (link < -1 || link >= total || (link != -1 && pid_status != BLOCKED)) return at("bad wait_next");
+        blocked += pid_status == BLOCKED;
+        ready_count += pid_status == READY;
+    }
+
+    // Each wait queue runs head to tail through BLOCKED processes waiting on it.
+    int queued = 0;
+    for (int id = 0; id < semaphores; id++) {
+        SnapshotSemaphore saved = read(sems, id, SnapshotSemaphore());
+        string queue = "semaphore " + to_string(id) + ": bad wait queue";
+        if (saved.size < 0 || saved.size > total || saved.head < -1 || saved.head >= total
+            || saved.tail < -1 || saved.tail >= total) {
+            return bad(queue);
+        }
+        int n = 0, last = -1;
+        for (int pid = saved.head; pid != -1; pid = read(next, pid, int32_t())) {
+            if (n++ == saved.size || waiting_on[pid] != id) return bad(queue);
+            last = pid;
+        }
+        if (n != saved.size || last != saved.tail) return bad(queue);
+        queued += n;
+    }
+    if (queued != blocked) return bad("BLOCKED processes missing from the wait queues");
+
+    vector<uint8_t> seen(total, 0);
+    for (int slot = 0; slot < ready_count; slot++) {
+        int32_t pid = read(ready, slot, int32_t());
+        if (pid < 0 || pid >= total || status[pid] != READY || seen[pid]++) return bad("bad READY set");
+    }
+    return true;
+}
+
+// Map path into file and set cfg up to rebuild the saved population.
+bool load_snapshot(const string &path, Config &cfg, SnapshotFile &file, string &error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        error = "cannot open " + path;
+        return false;
+    }
+    file.size = info.st_size;
+    void *mapped = file.size >= sizeof(SnapshotHeader) ? mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        error = path + " is not a version " + to_string(SNAPSHOT_VERSION) + " snapshot";
+        return false;
+    }
+    file.data = (const uint8_t *) mapped;
+    memcpy(&file.header, file.data, sizeof(SnapshotHeader));
+    const SnapshotHeader &header = file.header;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 || header.version != SNAPSHOT_VERSION
+        || header.readers < 0 || header.writers < 0 || (long) header.readers + header.writers > MAX_PROCESSES
+        || snapshot_bytes(header) != file.size) {
+        error = path + " is not a version " + to_string(SNAPSHOT_VERSION) + " snapshot";
+        return false;
+    }
+    if (header.semaphores != semaphore_names(cfg).size()) {
+        error = path + " was saved with " + to_string(header.semaphores) + " semaphores; pass the same --protocol";
+        return false;
+    }
+    if (!check_snapshot(file, cfg, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+    cfg.readers = header.readers;
+    cfg.writers = header.writers;
+    cfg.reader_limit = header.reader_limit;
+    cfg.run_to_block = header.run_to_block;
+    return true;
+}
+
+// Overwrite sim, freshly reset with the cfg load_snapshot set up, with the saved state.
+void restore_snapshot(Simulation &sim, const SnapshotFile &file) {
+    const SnapshotHeader &header = file.header;
+    ProcessTable &processes = sim.processes;
+    size_t total = processes.size();
+    const uint8_t *in = file.data + sizeof(SnapshotHeader);
+    for (int id = 0; id < header.semaphores; id++) {
+        SnapshotSemaphore saved;
+        snapshot_get(in, &saved, 1);
+        SimSemaphore &sem = semaphore(sim, id);
+        sem.value = saved.value;
+        sem.wait_queue = {saved.head, saved.tail, saved.size};
+    }
+    for (int v = 0; v < header.shared; v++) {
+        int32_t value;
+        snapshot_get(in, &value, 1);
+        shared_var(sim, v) = value;
+    }
+    snapshot_get(in, processes.program_counter.data(), total);
+    snapshot_get(in, processes.wait_next.data(), total);
+    for (size_t pid = 0; pid < total; pid++) {
+        if (processes.wait_next[pid] != -1) processes.wait_prev[processes.wait_next[pid]] = (int) pid;
+    }
+    snapshot_get(in, processes.status.data(), total);
+    snapshot_get(in, processes.type.data(), total);
+    snapshot_get(in, processes.waiting_on.data(), total);
+    snapshot_get(in, sim.ready_set.pids.data(), total);
+    if (header.metrics) {
+        if (sim.metrics) {
+            WaitStats &stats = sim.wait_stats;
+            snapshot_get(in, stats.first_wait.data(), total);
+            snapshot_get(in, stats.blocked_since.data(), total);
+            snapshot_get(in, stats.blocked_steps.data(), total);
+            snapshot_get(in, stats.blocks.data(), total);
+            snapshot_get(in, stats.held_since.data(), stats.held_since.size());
+        }
+    }
+
+    ReadySet &ready_set = sim.ready_set;
+    ready_set.size = count(processes.status.begin(), processes.status.end(), READY);
+    fill(ready_set.slot.begin(), ready_set.slot.end(), -1);
+    for (int s = 0; s < ready_set.size; s++) ready_set.slot[ready_set.pids[s]] = s;
+    wait_for_reset(sim);
+    for (size_t pid = 0; pid < total; pid++) {
+        if (processes.status[pid] == BLOCKED) wait_for_blocked(sim, pid, processes.waiting_on[pid]);
+    }
+
+    sim.active_readers = header.active_readers;
+    sim.active_writers = header.active_writers;
+    sim.dirty = header.dirty;
+    sim.violated = header.violated;
+    memcpy(sim.rng.s, header.rng, sizeof(header.rng));
+    sim.steps = header.steps;
+    sim.dispatches = header.dispatches;
+    sim.blocks = header.blocks;
+    sim.panics = header.panics;
+}
+
+///// ---  SNAPSHOT END ----- /////
+
+///// ---  EXPLORER START --- /////
+
+// Largest population the explorer accepts, so queue lengths, pids and CS
+// counters fit a state's bytes. Program counters, semaphore values and shared
+// variables depend on the programs and are checked as states are encoded.
+const int EXPLORE_MAX_PROCESSES = 100;
+const char *const STATE_OVERFLOW = "a program counter past 255, or a semaphore or shared variable outside [-128, 127]";
+
+inline bool fits_int8(int value) { return value >= INT8_MIN && value <= INT8_MAX; }
+
+// Fixed-length state encoding: per process (pc, status), per semaphore (value,
+// queue length, queue padded to N pids), then the shared variables and the
+// two CS counters.
+int state_size(const Simulation &sim) {
+    int total = sim.processes.size();
+    int semaphores = SEM_BUILTIN_COUNT + (int) sim.extra_semaphores.size();
+    int shared = 1 + (int) sim.extra_shared.size();
+    return 2 * total + semaphores * (2 + total) + shared + 2;
+}
+
+void encode_semaphore(const ProcessTable &processes, const SimSemaphore &sem, uint8_t *&out, bool &fits) {
+    int total = processes.size();
+    fits &= fits_int8(sem.value);
+    *out++ = (uint8_t) (int8_t) sem.value;
+    *out++ = (uint8_t) sem.wait_queue.size;
+    int n = 0;
+    for (int pid = sem.wait_queue.head; pid != -1; pid = processes.wait_next[pid]) { *out++ = (uint8_t) pid; n++; }
+    for (; n < total; n++) *out++ = 0;
+}
+
+void decode_semaphore(ProcessTable &processes, SimSemaphore &sem, const uint8_t *&in) {
+    int total = processes.size();
+    sem.value = (int8_t) *in++;
+    int len = *in++;
+    sem.wait_queue = {};
+    for (int n = 0; n < len; n++) {
+        wait_push_back(processes, sem.wait_queue, in[n]);
+        processes.waiting_on[in[n]] = sem.id;
+    }
+    in += total;
+}
+
+// False if some field does not fit its byte (see STATE_OVERFLOW); out is then unusable.
+bool encode_state(const Simulation &sim, uint8_t *out) {
+    int total = sim.processes.size();
+    bool fits = true;
+    for (int pid = 0; pid < total; pid++) {
+        fits &= sim.processes.program_counter[pid] <= UINT8_MAX;
+        *out++ = (uint8_t) sim.processes.program_counter[pid];
+        *out++ = sim.processes.status[pid];
+    }
+    encode_semaphore(sim.processes, sim.read_count_lock, out, fits);
+    encode_semaphore(sim.processes, sim.wrt, out, fits);
+    encode_semaphore(sim.processes, sim.reader_limiter, out, fits);
+    for (const SimSemaphore &sem : sim.extra_semaphores) encode_semaphore(sim.processes, sem, out, fits);
+    fits &= fits_int8(sim.read_count);
+    *out++ = (uint8_t) sim.read_count;
+    for (int value : sim.extra_shared) {
+        fits &= fits_int8(value);
+        *out++ = (uint8_t) value;
+    }
+    *out++ = (uint8_t) sim.active_readers;
+    *out++ = (uint8_t) sim.active_writers;
+    return fits;
+}
+
+// Inverse of encode_state; the process types and reader_limit already in sim are kept.
+void decode_state(Simulation &sim, const uint8_t *in) {
+    int total = sim.processes.size();
+    sim.ready_set.size = 0;
+    for (int pid = 0; pid < total; pid++) {
+        sim.processes.program_counter[pid] = *in++;
+        sim.processes.waiting_on[pid] = SEM_NONE;
+        sim.ready_set.slot[pid] = -1;
+        set_status(sim, pid, (Status) *in++);
+    }
+    decode_semaphore(sim.processes, sim.read_count_lock, in);
+    decode_semaphore(sim.processes, sim.wrt, in);
+    decode_semaphore(sim.processes, sim.reader_limiter, in);
+    for (SimSemaphore &sem : sim.extra_semaphores) decode_semaphore(sim.processes, sem, in);
+    sim.read_count = (int8_t) *in++;
+    for (int &value : sim.extra_shared) value = (int8_t) *in++;
+    sim.active_readers = *in++;
+    sim.active_writers = *in++;
+    // Only non-violating states get expanded, so nothing counts as broken yet.
+    sim.dirty = 0;
+    sim.violated = 0;
+}
+
+// Visited-state set. Encoded states are packed back to back in one arena (in
+// discovery order, so the arena doubles as the BFS queue); the open-addressing
+// table only stores arena index + 1, with 0 meaning empty.
+struct StateStore {
+    int state_bytes;
+    vector<uint8_t> arena;
+    vector<uint32_t> parent;  // index of the state this one was reached from
+    vector<uint8_t> via_pid;  // pid stepped to get here
+    vector<uint32_t> table;
+
+    explicit StateStore(int bytes) : state_bytes(bytes), table(1 << 16, 0) {}
+
+    uint32_t count() const { return (uint32_t) parent.size(); }
+    const uint8_t *state(uint32_t index) const { return arena.data() + (size_t) index * state_bytes; }
+
+    size_t hash(const uint8_t *bytes) const {
+        return std::hash<string_view>{}(string_view((const char *) bytes, state_bytes));
+    }
+
+    void grow() {
+        vector<uint32_t> old;
+        old.swap(table);
+        table.assign(old.size() * 2, 0);
+        size_t mask = table.size() - 1;
+        for (uint32_t entry : old) {
+            if (entry == 0) continue;
+            size_t h = hash(state(entry - 1)) & mask;
+            while (table[h] != 0) h = (h + 1) & mask;
+            table[h] = entry;
+        }
+    }
+
+    // Add bytes unless already present; true if it was new. at (if given)
+    // receives the index of the new or already stored copy.
+    bool insert(const uint8_t *bytes, uint32_t from, int pid, uint32_t *at = nullptr) {
+        if ((size_t) count() * 2 >= table.size()) grow();
+        size_t mask = table.size() - 1;
+        size_t h = hash(bytes) & mask;
+        while (table[h] != 0) {
+            if (equal(bytes, bytes + state_bytes, state(table[h] - 1))) {
+                if (at) *at = table[h] - 1;
+                return false;
+            }
+            h = (h + 1) & mask;
+        }
+        if (at) *at = count();
+        table[h] = count() + 1;
+        arena.insert(arena.end(), bytes, bytes + state_bytes);
+        parent.push_back(from);
+        via_pid.push_back((uint8_t) pid);
+        return true;
+    }
+};
+
+// pids stepped from the initial state to reach index, in order.
+vector<int> schedule_to(const StateStore &store, uint32_t index) {
+    vector<int> schedule;
+    while (index != 0) {
+        schedule.push_back(store.via_pid[index]);
+        index = store.parent[index];
+    }
+    reverse(schedule.begin(), schedule.end());
+    return schedule;
+}
+
+// Re-run schedule from the initial state with full output, to show how a
+// violating or deadlocked state is reached.
+void print_counterexample(const Config &cfg, const vector<int> &schedule) {
+    cout << "Schedule (" << schedule.size() << " scheduler picks):";
+    for (int pid : schedule) cout << " " << pid;
+    cout << "\n" << endl;
+
+    Trace text;
+    trace_open(text, TRACE_TEXT, stdout);
+    if (cfg.protocol) text.sem_names = &cfg.protocol->sem_names;
+    text.invariants = cfg.protocol ? &cfg.protocol->invariants : &BUILTIN_INVARIANTS;
+    Simulation sim;
+    reset_simulation(sim, cfg);
+    sim.trace = &text;
+    for (int pid : schedule) dispatch_process(sim, pid);
+    if (sim.wait_for.stuck != SEM_NONE) {
+        int live = (int) count_if(sim.processes.status.begin(), sim.processes.status.end(),
+                                  [](Status status) { return status != FINISHED; });
+        report_deadlock(sim, live);
+    }
+    trace_flush(text);
+}
+
+// Breadth-first search over every reachable state: from each state, dispatch
+// every READY process once (a single step, or a whole block with run_to_block). Panic states are recorded but not expanded further.
+// Returns true when no reachable state panics or deadlocks.
+bool run_explorer(const Config &cfg) {
+    int total = cfg.readers + cfg.writers;
+    if (total > EXPLORE_MAX_PROCESSES) {
+        cout << "Explorer supports at most " << EXPLORE_MAX_PROCESSES << " processes." << endl;
+        return false;
+    }
+
+    Simulation sim;
+    reset_simulation(sim, cfg);
+    sim.detect_deadlock = false; // deadlocks are found as states with nothing READY
+
+    int bytes = state_size(sim);
+    StateStore store(bytes);
+    vector<uint8_t> scratch(bytes);
+    bool fits = encode_state(sim, scratch.data());
+    store.insert(scratch.data(), 0, 0);
+
+    long transitions = 0, finished_states = 0, panic_states = 0, deadlock_states = 0;
+    uint32_t first_panic = 0, first_deadlock = 0; // 0 = none (the initial state is neither)
+    vector<int> ready;
+
+    double start = omp_get_wtime();
+    for (uint32_t index = 0; index < store.count(); index++) {
+        decode_state(sim, store.state(index));
+
+        // Invariants are functions of the state, so re-checking here is exact.
+        if (!invariants_hold(sim)) {
+            if (panic_states++ == 0) first_panic = index;
+            continue;
+        }
+
+        if (sim.ready_set.size == 0) {
+            bool all_finished = count(sim.processes.status.begin(), sim.processes.status.end(), FINISHED) == total;
+            if (all_finished) finished_states++;
+            else if (deadlock_states++ == 0) first_deadlock = index;
+            continue;
+        }
+
+        ready.assign(sim.ready_set.pids.begin(), sim.ready_set.pids.begin() + sim.ready_set.size);
+        for (int pid : ready) {
+            decode_state(sim, store.state(index));
+            dispatch_process(sim, pid);
+            transitions++;
+            fits &= encode_state(sim, scratch.data());
+            store.insert(scratch.data(), index, pid);
+        }
+        if (!fits) break;
+    }
+    double elapsed = omp_get_wtime() - start;
+    if (!fits) {
+        cout << "Explorer state encoding overflowed: " << STATE_OVERFLOW << "." << endl;
+        return false;
+    }
+
+    cout << "Explored " << store.count() << " states, " << transitions << " transitions in " << elapsed << " s" << endl;
+    cout << "Readers: " << cfg.readers << ", Writers: " << cfg.writers << ", Reader limit: " << cfg.reader_limit << endl;
+    cout << "Completed states: " << finished_states << endl;
+    cout << "PANIC states: " << panic_states << endl;
+    cout << "Deadlocked states: " << deadlock_states << endl;
+
+    if (first_panic != 0 || first_deadlock != 0) {
+        cout << "\nShortest path to " << (first_panic != 0 ? "PANIC" : "DEADLOCK") << ":" << endl;
+        print_counterexample(cfg, schedule_to(store, first_panic != 0 ? first_panic : first_deadlock));
+        return false;
+    }
+    cout << "VERIFIED: no reachable state violates the rules or deadlocks." << endl;
+    return true;
+}
+
+///// ---  EXPLORER END ----- /////
+
+
+///// ---  DPOR START --- /////
+
+// Footprint bits are state variable bits (see var_bit). A step that writes a
+// variable also reads every variable an invariant checks together with it,
+// so two writes that could jointly break an invariant are never reordered.
+// Bitmasks of objects one step reads and writes (semaphore ops are writes).
+struct Footprint {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+
+    void add(Footprint other) {
+        reads |= other.reads;
+        writes |= other.writes;
+    }
+};
+
+bool dependent(Footprint a, Footprint b) {
+    return (a.writes & (b.reads | b.writes)) || (b.writes & a.reads);
+}
+
+// What the next step of pid touches in the current state, read off its
+// instruction; steps with an empty footprint commute with everything.
+Footprint next_footprint(const Simulation &sim, int pid) {
+    const Instruction &next = next_instruction(sim, pid);
+    uint64_t sem = next.sem == SEM_NONE ? 0 : var_bit(next.sem);
+    uint64_t var = var_bit(VAR_SHARED_BASE + next.var);
+    uint64_t counter = var_bit(next.var == READER ? VAR_ACTIVE_READERS : VAR_ACTIVE_WRITERS);
+    Footprint fp;
+    switch (next.op) {
+        case OP_WAIT: case OP_SIGNAL: fp = {0, sem}; break;
+        case OP_WAIT_IF: case OP_SIGNAL_IF: fp = {var, shared_var(sim, next.var) == next.when ? sem : 0}; break;
+        case OP_INC_SHARED: case OP_DEC_SHARED: fp = {0, var}; break;
+        case OP_ENTER_CS: fp = {0, counter}; break;
+        case OP_EXIT_CS: fp = {0, counter | sem}; break;
+        default: return {}; // busy work, finish
+    }
+    for (uint64_t w = fp.writes & sim.invariants->watched; w; w &= w - 1) {
+        fp.reads |= sim.invariants->related[__builtin_ctzll(w)];
+    }
+    return fp;
+}
+
+// One step of the current execution plus the state it was taken from.
+struct DporFrame {
+    vector<uint8_t> state;
+    uint64_t enabled = 0;   // READY pids in state
+    uint64_t backtrack = 0; // pids that still must be tried from state
+    uint64_t done = 0;      // pids already tried from state
+    vector<Footprint> next; // footprint of every process's pending step in state
+    vector<int> proc_clock; // total x total: vector clock of each process in state
+    int pid = -1;           // step currently taken from state
+    Footprint access;
+    vector<int> clock;      // vector clock of that step (1-based step indices)
+};
+
+// Stateful dynamic partial-order reduction (Flanagan & Godefroid, with a
+// visited-state cache after Yang et al.): DFS over executions, adding a
+// backtrack point only where the next step of a process races with an earlier,
+// dependent step that does not happen-before it. Each state is expanded once;
+// reaching it again instead races everything explored below it (kept per pid
+// in reach) against the current stack, so a race hidden by the cache still
+// gets its reversal. Frames are reused between executions, so the stack
+// allocates only while it first grows.
+struct DporSearch {
+    const Config &cfg;
+    Simulation sim;
+    int total;
+    vector<DporFrame> stack;
+    vector<Status> before;
+    StateStore visited;
+    vector<Footprint> reach;   // visited.count() x total: union of each pid's steps below a state
+    vector<uint8_t> expanding; // per visited state: still on the stack
+
+    long completed = 0; // states where every process finished
+    long revisits = 0;  // steps that reached an already expanded state
+    long transitions = 0;
+    bool violation = false; // also set (to stop the search) on overflow
+    bool violation_is_panic = false;
+    bool overflow = false;  // a state did not fit encode_state's bytes
+    vector<int> bad_schedule;
+
+    explicit DporSearch(const Config &c) : cfg(c), total(c.readers + c.writers), visited(0) {
+        reset_simulation(sim, cfg);
+        sim.detect_deadlock = false; // executions end when nothing is READY
+        visited.state_bytes = state_size(sim); // known once sim is laid out
+    }
+
+    DporFrame &frame_at(int depth) {
+        if ((int) stack.size() <= depth) {
+            stack.resize(depth + 1);
+            DporFrame &frame = stack[depth];
+            frame.state.resize(visited.state_bytes);
+            frame.next.resize(total);
+            frame.proc_clock.assign(total * total, 0);
+            frame.clock.resize(total);
+        }
+        return stack[depth];
+    }
+
+    void record_violation(int depth, bool panic) {
+        violation = true;
+        violation_is_panic = panic;
+        for (int i = 0; i < depth; i++) bad_schedule.push_back(stack[i].pid);
+    }
+
+    // Add a backtrack point at the latest step below depth that fp races with:
+    // dependent, by another process and not ordered before q. When fp is q's
+    // pending step that one race is enough; when it sums up steps q takes
+    // further on, the latest race on each object fp touches is reversed.
+    void add_races(int depth, int q, Footprint fp, bool pending) {
+        const int *q_clock = &stack[depth].proc_clock[q * total];
+        uint64_t open = pending ? ~0ull : fp.reads | fp.writes;
+        for (int i = depth - 1; i >= 0 && open; i--) {
+            DporFrame &earlier = stack[i];
+            uint64_t conflict = (earlier.access.writes & (fp.reads | fp.writes)) | (fp.writes & earlier.access.reads);
+            if (earlier.pid == q || !(conflict & open)) continue;
+            if (i + 1 <= q_clock[earlier.pid]) continue; // already ordered
+            if (earlier.enabled & (1ull << q)) earlier.backtrack |= 1ull << q;
+            else earlier.backtrack |= earlier.enabled;
+            open &= pending ? 0 : ~conflict;
+        }
+    }
+
+    // sim holds the state reached after depth steps, whose process clocks are
+    // already in frame_at(depth). Returns the state's index in visited.
+    uint32_t explore(int depth) {
+        DporFrame &frame = frame_at(depth);
+        if (!encode_state(sim, frame.state.data())) {
+            overflow = violation = true;
+            return 0;
+        }
+        uint32_t index;
+        if (!visited.insert(frame.state.data(), 0, 0, &index)) {
+            revisits++;
+            if (expanding[index]) {
+                // Closed a cycle: what lies below is not known yet, so try everything.
+                for (int i = 0; i < depth; i++) stack[i].backtrack |= stack[i].enabled;
+                return index;
+            }
+            for (int q = 0; q < total; q++) {
+                Footprint below = reach[(size_t) index * total + q];
+                if (sim.processes.status[q] == READY) below.add(next_footprint(sim, q));
+                if (below.reads | below.writes) add_races(depth, q, below, false);
+            }
+            return index;
+        }
+        expanding.push_back(1);
+        reach.resize(reach.size() + total);
+
+        if (sim.ready_set.size == 0) {
+            if (count(sim.processes.status.begin(), sim.processes.status.end(), FINISHED) == total) completed++;
+            else record_violation(depth, false);
+            expanding[index] = 0;
+            return index;
+        }
+
+        // Race detection: for each pending step, find the latest earlier dependent
+        // step of another process that does not happen-before it.
+        uint64_t enabled = 0;
+        for (int r = 0; r < sim.ready_set.size; r++) {
+            int p = sim.ready_set.pids[r];
+            enabled |= 1ull << p;
+            frame.next[p] = next_footprint(sim, p);
+            add_races(depth, p, frame.next[p], true);
+        }
+        // Keep running the process that got here, so its independent steps are
+        // not interleaved with everyone else's unless a race asks for it.
+        uint64_t last = depth > 0 ? 1ull << stack[depth - 1].pid : 0;
+        frame.enabled = enabled;
+        frame.backtrack = enabled & last ? last : enabled & -enabled;
+        frame.done = 0;
+
+        while (!violation && (stack[depth].backtrack & ~stack[depth].done)) {
+            int p = __builtin_ctzll(stack[depth].backtrack & ~stack[depth].done);
+            stack[depth].done |= 1ull << p;
+
+            decode_state(sim, stack[depth].state.data());
+            Footprint access = stack[depth].next[p];
+            before = sim.processes.status;
+            sim.panics = 0;
+            step_process(sim, p);
+            transitions++;
+
+            // Step clock: join p's clock with every earlier dependent step.
+            DporFrame &child = frame_at(depth + 1); // may reallocate stack
+            DporFrame &here = stack[depth];
+            int *clock = here.clock.data();
+            copy_n(&here.proc_clock[p * total], total, clock);
+            for (int i = 0; i < depth; i++) {
+                if (!dependent(stack[i].access, access)) continue;
+                for (int q = 0; q < total; q++) clock[q] = max(clock[q], stack[i].clock[q]);
+            }
+            clock[p] = depth + 1;
+            here.pid = p;
+            here.access = access;
+
+            if (sim.panics > 0) {
+                record_violation(depth + 1, true);
+                return index;
+            }
+
+            // A process woken by this step's SemSignal is ordered after it.
+            child.proc_clock = here.proc_clock;
+            copy_n(clock, total, &child.proc_clock[p * total]);
+            for (int q = 0; q < total; q++) {
+                if (before[q] != BLOCKED || sim.processes.status[q] == BLOCKED) continue;
+                int *q_clock = &child.proc_clock[q * total];
+                for (int k = 0; k < total; k++) q_clock[k] = max(q_clock[k], clock[k]);
+            }
+            uint32_t below = explore(depth + 1);
+
+            // reach may have grown during the call, so index it only now.
+            Footprint *summary = &reach[(size_t) index * total];
+            const Footprint *child_reach = &reach[(size_t) below * total];
+            summary[p].add(access);
+            for (int q = 0; q < total; q++) summary[q].add(child_reach[q]);
+        }
+        expanding[index] = 0;
+        return index;
+    }
+};
+
+// Returns true when no explored execution panics or deadlocks. Expands a
+// subset of --explore's states, at a higher cost per step: on the built-in
+// protocol it overtakes --explore from about 3 readers and 3 writers, and on
+// protocols with private work (protocols/think_time.txt) it is ~10x ahead.
+bool run_dpor(const Config &dpor_cfg) {
+    Config cfg = dpor_cfg;
+    cfg.run_to_block = false; // footprints and replay are per single step
+    int total = cfg.readers + cfg.writers;
+    if (total > 64 || total > EXPLORE_MAX_PROCESSES) {
+        cout << "DPOR supports at most 64 processes." << endl;
+        return false;
+    }
+
+    DporSearch search(cfg);
+    double start = omp_get_wtime();
+    search.explore(0);
+    double elapsed = omp_get_wtime() - start;
+
+    cout << "DPOR expanded " << search.visited.count() << " states (" << search.revisits << " revisits cut), "
+         << search.transitions << " transitions in " << elapsed << " s" << endl;
+    cout << "Readers: " << cfg.readers << ", Writers: " << cfg.writers << ", Reader limit: " << cfg.reader_limit << endl;
+    cout << "Completed states: " << search.completed << endl;
+
+    if (search.overflow) {
+        cout << "DPOR state encoding overflowed: " << STATE_OVERFLOW << "." << endl;
+        return false;
+    }
+    if (search.violation) {
+        cout << "\nFound " << (search.violation_is_panic ? "PANIC" : "DEADLOCK") << ":" << endl;
+        print_counterexample(cfg, search.bad_schedule);
+        return false;
+    }
+    cout << "VERIFIED: no execution violates the rules or deadlocks." << endl;
+    return true;
+}
+
+///// ---  DPOR END ----- /////
+
+
+///// ---  REAL THREADS START --- /////
+
+// The same programs on one std::thread per process, with every semaphore a
+// std::counting_semaphore and every shared variable an atomic. Each thread
+// runs its program `rounds` times; CS entries check the invariants that only
+// read observable state (the CS counters and shared variables).
+
+const int THREAD_BUSY_SPINS = 256;  // work done by a reader's busy step
+const auto THREAD_POLL = chrono::milliseconds(50);
+const double THREAD_STALL_SECONDS = 2; // no round finished anywhere for this long = deadlock
+
+struct ThreadShared {
+    vector<unique_ptr<counting_semaphore<>>> semaphores; // indexed by SemId
+    vector<atomic<int>> shared;                          // indexed by SharedVar
+    atomic<int> active_readers{0};
+    atomic<int> active_writers{0};
+    vector<atomic<long>> violations;                     // per invariant
+    uint64_t checked = 0;                                // invariants evaluated at CS entry
+    const InvariantSet *invariants = nullptr;
+    int reader_limit = 2;
+    atomic<bool> abort{false};
+
+    ThreadShared(int semaphore_count, int shared_count, int invariant_count)
+        : semaphores(semaphore_count), shared(shared_count), violations(invariant_count) {}
+};
+
+// One thread's counters; padded so progress polling never shares a line.
+struct alignas(64) ThreadWorker {
+    atomic<long> rounds{0};
+    long cs_entries = 0;
+    chrono::steady_clock::time_point finished;
+    vector<Histogram> wait_ns; // [semaphore]: acquire latencies
+};
+
+// Acquire sem, polling so a deadlocked run can be called off; false if it was.
+bool thread_acquire(ThreadShared &shared, ThreadWorker &worker, int sem) {
+    auto start = chrono::steady_clock::now();
+    while (!shared.semaphores[sem]->try_acquire_for(THREAD_POLL)) {
+        if (shared.abort.load(memory_order_relaxed)) return false;
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    worker.wait_ns[sem].record((uint64_t) ns);
+    return true;
+}
+
+// The counters just moved into the CS: evaluate the observable invariants on a snapshot.
+void thread_check(ThreadShared &shared, Simulation &view) {
+    view.active_readers = shared.active_readers.load();
+    view.active_writers = shared.active_writers.load();
+    view.read_count = shared.shared[0].load(memory_order_relaxed);
+    for (size_t v = 1; v < shared.shared.size(); v++) view.extra_shared[v - 1] = shared.shared[v].load(memory_order_relaxed);
+    for (uint64_t m = shared.checked; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        const Invariant &inv = shared.invariants->invariants[i];
+        if (!inv.holds(view, inv)) shared.violations[i]++;
+    }
+}
+
+void thread_body(ThreadShared &shared, ThreadWorker &worker, const Instruction *program, long rounds) {
+    Simulation view; // only what invariants read
+    view.reader_limit = shared.reader_limit;
+    view.extra_shared.assign(shared.shared.size() - 1, 0);
+    volatile int sink = 0;
+
+    for (long round = 0; round < rounds; round++) {
+        for (int pc = 0; program[pc].op != OP_FINISH; pc++) {
+            const Instruction &ins = program[pc];
+            switch (ins.op) {
+                case OP_WAIT:
+                    if (!thread_acquire(shared, worker, ins.sem)) return;
+                    break;
+                case OP_SIGNAL:
+                    shared.semaphores[ins.sem]->release();
+                    break;
+                case OP_WAIT_IF:
+                    if (shared.shared[ins.var].load() == ins.when && !thread_acquire(shared, worker, ins.sem)) return;
+                    break;
+                case OP_SIGNAL_IF:
+                    if (shared.shared[ins.var].load() == ins.when) shared.semaphores[ins.sem]->release();
+                    break;
+                case OP_INC_SHARED: shared.shared[ins.var]++; break;
+                case OP_DEC_SHARED: shared.shared[ins.var]--; break;
+                case OP_ENTER_CS:
+                    (ins.var == READER ? shared.active_readers : shared.active_writers)++;
+                    worker.cs_entries++;
+                    thread_check(shared, view);
+                    break;
+                case OP_EXIT_CS:
+                    (ins.var == READER ? shared.active_readers : shared.active_writers)--;
+                    if (ins.sem != SEM_NONE) shared.semaphores[ins.sem]->release();
+                    break;
+                default: // busy work
+                    for (int i = 0; i < THREAD_BUSY_SPINS; i++) sink = sink + i;
+                    break;
+            }
+        }
+        worker.rounds.store(round + 1, memory_order_relaxed);
+    }
+    worker.finished = chrono::steady_clock::now();
+}
+
+// mean / p50 / p99 / max of one semaphore's acquire latencies, in ns.
+void print_latency(const string &name, const Histogram &ns) {
+    if (ns.total == 0) return;
+    cout << "  " << name << ": " << ns.total << " acquires, mean " << (double) ns.sum / ns.total << ", p50 "
+         << ns.percentile(0.50) << ", p99 " << ns.percentile(0.99) << ", max " << ns.max << endl;
+}
+
+// Returns true when every thread finished its rounds without a panic.
+bool run_threads(const Config &cfg) {
+    int total = cfg.readers + cfg.writers;
+    const InvariantSet &invariants = cfg.protocol ? cfg.protocol->invariants : BUILTIN_INVARIANTS;
+    int semaphore_count = cfg.protocol ? (int) cfg.protocol->sem_names.size() : SEM_BUILTIN_COUNT;
+    int shared_count = cfg.protocol ? (int) cfg.protocol->shared_names.size() : 1;
+
+    ThreadShared shared(semaphore_count, shared_count, (int) invariants.invariants.size());
+    for (int id = 0; id < semaphore_count; id++) {
+        int initial = id == SEM_READER_LIMITER ? cfg.reader_limit : 1;
+        if (cfg.protocol) initial = cfg.protocol->sem_initial[id] == INITIAL_LIMIT ? cfg.reader_limit : cfg.protocol->sem_initial[id];
+        if (initial < 0) {
+            cout << "Threads need non-negative initial semaphore values." << endl;
+            return false;
+        }
+        shared.semaphores[id] = make_unique<counting_semaphore<>>(initial);
+    }
+    shared.invariants = &invariants;
+    shared.reader_limit = cfg.reader_limit;
+    uint64_t semaphore_vars = var_bit(VAR_SHARED_BASE) - 1; // semaphore values can't be read off a counting_semaphore
+    for (size_t i = 0; i < invariants.invariants.size(); i++) {
+        if (!(invariants.invariants[i].depends & semaphore_vars)) shared.checked |= 1ull << i;
+    }
+
+    vector<ThreadWorker> workers(total);
+    for (ThreadWorker &worker : workers) worker.wait_ns.resize(semaphore_count);
+    vector<thread> threads;
+    threads.reserve(total);
+    auto start = chrono::steady_clock::now();
+    for (int pid = 0; pid < total; pid++) {
+        ProcType type = pid < cfg.readers ? READER : WRITER;
+        const Instruction *program = cfg.protocol ? cfg.protocol->programs[type].code.data() : PROGRAMS[type];
+        threads.emplace_back(thread_body, ref(shared), ref(workers[pid]), program, cfg.rounds);
+    }
+
+    // Watchdog: call the run off once no thread has finished a round for a while.
+    long last_progress = -1;
+    auto last_change = chrono::steady_clock::now();
+    for (;;) {
+        this_thread::sleep_for(THREAD_POLL);
+        long progress = 0;
+        for (ThreadWorker &worker : workers) progress += worker.rounds.load(memory_order_relaxed);
+        if (progress == (long) total * cfg.rounds) break;
+        auto now = chrono::steady_clock::now();
+        if (progress != last_progress) {
+            last_progress = progress;
+            last_change = now;
+        } else if (chrono::duration<double>(now - last_change).count() >= THREAD_STALL_SECONDS) {
+            shared.abort = true;
+            break;
+        }
+    }
+    for (thread &t : threads) t.join();
+    auto end = start;
+    for (ThreadWorker &worker : workers) end = max(end, worker.finished);
+    if (shared.abort) end = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(end - start).count();
+
+    long rounds = 0, cs_entries = 0, panics = 0;
+    for (ThreadWorker &worker : workers) {
+        rounds += worker.rounds;
+        cs_entries += worker.cs_entries;
+    }
+    cout << "Threads: " << cfg.readers << " readers + " << cfg.writers << " writers, " << cfg.rounds
+         << " rounds each, in " << elapsed << " s" << endl;
+    cout << "Reader limit: " << cfg.reader_limit << endl;
+    cout << "Throughput: " << rounds / elapsed << " rounds/s, " << cs_entries / elapsed << " CS entries/s" << endl;
+    for (size_t i = 0; i < invariants.invariants.size(); i++) {
+        if (!(shared.checked & (1ull << i))) {
+            cout << "Not checked (reads semaphore values): " << invariants.invariants[i].name << endl;
+        } else if (shared.violations[i] > 0) {
+            cout << "PANIC: " << invariants.invariants[i].name << " violated " << shared.violations[i] << " times" << endl;
+            panics += shared.violations[i];
+        }
+    }
+    cout << "Total panics: " << panics << endl;
+    cout << "Acquire latency (ns, percentiles within 1/16):" << endl;
+    for (int id = 0; id < semaphore_count; id++) {
+        Histogram ns;
+        for (ThreadWorker &worker : workers) ns.merge(worker.wait_ns[id]);
+        print_latency(cfg.protocol ? cfg.protocol->sem_names[id] : SEM_NAMES[id], ns);
+    }
+    if (shared.abort) {
+        cout << "STALLED: no round finished for " << THREAD_STALL_SECONDS << " s (deadlock?); "
+             << rounds << " of " << (long) total * cfg.rounds << " rounds done" << endl;
+        return false;
+    }
+    return panics == 0;
+}
+
+///// ---  REAL THREADS END ----- /////
+
+void print_usage(const char *prog) {
+    cout << "Usage: " << prog << " [--readers N] [--writers N] [--limit N] [--trials N [--lanes]] [--explore | --dpor] [--run-to-block]\n"
+         << "       [--threads [--rounds N]] [--coroutines] [--record PATH | --replay PATH [--stop-at STEP]]\n"
+         << "       [--snapshot PATH --snapshot-at STEP] [--restore PATH]\n"
+         << "       [--sweep csv|json [--axis readers|writers|limit|policy=V1,V2,...]...]\n"
+         << "       [--clock [--duration OP|all=N|LO-HI]... [--timeout T]]\n"
+         << "       [--wake SEM|all=fifo|lifo|writers-first|random]... [--compare-wake]\n"
+         << "       [--seed S] [--trial T] [--protocol FILE] [--trace bin|text|none] [--trace-file PATH] [--decode PATH]" << endl;
+}
+
+// Reads the command line into config; false on anything malformed.
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--explore") { config.explore = true; continue; }
+        if (arg == "--dpor") { config.dpor = true; continue; }
+        if (arg == "--run-to-block") { config.run_to_block = true; continue; }
+        if (arg == "--threads") { config.threads = true; continue; }
+        if (arg == "--coroutines") { config.coroutines = true; continue; }
+        if (arg == "--lanes") { config.lanes = true; continue; }
+        if (arg == "--clock") { config.clock = true; continue; }
+        if (arg == "--compare-wake") { config.compare_wake = true; continue; }
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+        long n = 0;
+        auto number = [&](long lo, long hi) { return parse_number(value, lo, hi, n); };
+        if (arg == "--readers") { if (!number(0, MAX_PROCESSES)) return false; config.readers = (int) n; }
+        else if (arg == "--writers") { if (!number(0, MAX_PROCESSES)) return false; config.writers = (int) n; }
+        else if (arg == "--limit") { if (!number(1, INT_MAX)) return false; config.reader_limit = (int) n; }
+        else if (arg == "--trials") { if (!number(0, LONG_MAX)) return false; config.trials = n; }
+        else if (arg == "--rounds") { if (!number(1, LONG_MAX)) return false; config.rounds = n; }
+        else if (arg == "--seed") {
+            char *end;
+            errno = 0;
+            config.seed = strtoull(value.c_str(), &end, 10);
+            if (value.empty() || value[0] == '-' || *end || errno == ERANGE) return false;
+            config.seed_given = true;
+        }
+        else if (arg == "--trial") { if (!number(0, LONG_MAX)) return false; config.trial = n; }
+        else if (arg == "--trace-file") config.trace_file = value;
+        else if (arg == "--protocol") config.protocol_file = value;
+        else if (arg == "--decode") config.decode_file = value;
+        else if (arg == "--record") config.record_file = value;
+        else if (arg == "--replay") config.replay_file = value;
+        else if (arg == "--stop-at") { if (!number(0, LONG_MAX)) return false; config.stop_at = n; }
+        else if (arg == "--snapshot") config.snapshot_file = value;
+        else if (arg == "--snapshot-at") { if (!number(0, LONG_MAX)) return false; config.snapshot_at = n; }
+        else if (arg == "--restore") config.restore_file = value;
+        else if (arg == "--timeout") { if (!number(0, INT_MAX)) return false; config.wait_timeout = n; }
+        else if (arg == "--wake") config.wake.push_back(value);
+        else if (arg == "--duration") {
+            if (!parse_duration(value, config)) return false;
+        }
+        else if (arg == "--axis") {
+            if (!parse_axis(value, config)) return false;
+        }
+        else if (arg == "--sweep") {
+            if (value != "csv" && value != "json") return false;
+            config.sweep = value;
+        }
+        else if (arg == "--trace") {
+            if (value == "bin") config.trace = TRACE_BINARY;
+            else if (value == "text") config.trace = TRACE_TEXT;
+            else if (value == "none") config.trace = TRACE_NONE;
+            else return false;
+        }
+        else return false;
+    }
+    // The largest sweep point has the most readers with the most writers.
+    auto largest = [](const vector<int> &axis, int single) { return axis.empty() ? single : *max_element(axis.begin(), axis.end()); };
+    return (long) largest(config.sweep_readers, config.readers) + largest(config.sweep_writers, config.writers) <= MAX_PROCESSES;
+}
+
+///// ---  BENCHMARKS START --- /////
+
+// Built only into the Project_3_bench target (see CMakeLists.txt), which
+// compiles this file with SIM_BENCHMARK defined and gets this main() instead.
+#ifdef SIM_BENCHMARK
+
+#ifndef PROTOCOL_DIR
+#define PROTOCOL_DIR "protocols"
+#endif
+
+struct BenchResult {
+    string name;
+    long iterations;
+    long ops;        // operations timed (steps, semaphore ops, lifecycles...)
+    double seconds;
+};
+
+// Double the iteration count until one timed batch of body(iterations) runs
+// for at least min_seconds; body returns how many operations it performed.
+template <typename Body>
+BenchResult bench(const string &name, Body body, double min_seconds = 0.25) {
+    for (long iterations = 1;; iterations *= 2) {
+        auto start = chrono::steady_clock::now();
+        long ops = body(iterations);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (seconds >= min_seconds || iterations >= (1L << 40)) {
+            cerr << name << ": " << seconds * 1e9 / ops << " ns/op" << endl;
+            return {name, iterations, ops, seconds};
+        }
+    }
+}
+
+// One reader or writer alone in the table, so every step of its program runs uncontended.
+void reset_single(Simulation &sim, ProcType type) {
+    Config cfg;
+    cfg.readers = type == READER ? 1 : 0;
+    cfg.writers = type == WRITER ? 1 : 0;
+    reset_simulation(sim, cfg);
+}
+
+vector<BenchResult> run_benchmarks() {
+    vector<BenchResult> results;
+    Simulation sim;
+
+    results.push_back(bench("sem_wait_signal_uncontended", [&](long n) {
+        reset_single(sim, WRITER);
+        for (long i = 0; i < n; i++) {
+            SemWait(sim, sim.wrt, 0);
+            SemSignal(sim, sim.wrt, 0);
+        }
+        return 2 * n;
+    }));
+
+    // Every waiter blocks on wrt (value 0), then every signal wakes one of them.
+    const int WAITERS = 1024;
+    Config contended;
+    contended.readers = 0;
+    contended.writers = WAITERS;
+    results.push_back(bench("sem_wait_signal_contended_1024", [&](long n) {
+        long ops = 0;
+        for (long i = 0; i < n; i++) {
+            reset_simulation(sim, contended);
+            sim.wrt.value = 0;
+            for (int pid = 0; pid < WAITERS; pid++) SemWait(sim, sim.wrt, pid);
+            for (int pid = 0; pid < WAITERS; pid++) SemSignal(sim, sim.wrt, pid);
+            ops += 2 * WAITERS;
+        }
+        return ops;
+    }));
+
+    // The same under the other wake policies, half the waiters readers so
+    // writers-first has someone to overtake. Random walks to its pick.
+    Config mixed = contended;
+    mixed.readers = WAITERS / 2;
+    mixed.writers = WAITERS / 2;
+    for (int policy = WAKE_LIFO; policy < WAKE_POLICY_COUNT; policy++) {
+        mixed.wake_policy[SEM_WRT] = (WakePolicy) policy;
+        results.push_back(bench(string("sem_wait_signal_contended_1024_") + WAKE_POLICY_NAMES[policy], [&](long n) {
+            long ops = 0;
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, mixed);
+                seed_trial(sim, 1, i);
+                sim.wrt.value = 0;
+                for (int pid = 0; pid < WAITERS; pid++) SemWait(sim, sim.wrt, pid);
+                for (int pid = 0; pid < WAITERS; pid++) SemSignal(sim, sim.wrt, pid);
+                ops += 2 * WAITERS;
+            }
+            return ops;
+        }));
+    }
+
+    results.push_back(bench("run_reader_lifecycle", [&](long n) {
+        for (long i = 0; i < n; i++) {
+            reset_single(sim, READER);
+            while (sim.processes.status[0] != FINISHED) run_reader(sim, 0);
+        }
+        return n;
+    }));
+
+    results.push_back(bench("run_writer_lifecycle", [&](long n) {
+        for (long i = 0; i < n; i++) {
+            reset_single(sim, WRITER);
+            while (sim.processes.status[0] != FINISHED) run_writer(sim, 0);
+        }
+        return n;
+    }));
+
+    // End to end: scheduler steps per second with half readers, half writers.
+    auto scheduler_steps = [&](const Config &cfg) {
+        return [&sim, cfg](long n) {
+            long steps = 0;
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                sim.rng.seed(1, i);
+                steps += run_simulation(sim).steps;
+            }
+            return steps;
+        };
+    };
+    for (int total : {6, 60, 600, 6000, 60000}) {
+        Config cfg;
+        cfg.readers = total / 2;
+        cfg.writers = total - total / 2;
+        results.push_back(bench("scheduler_steps_" + to_string(total), scheduler_steps(cfg)));
+    }
+
+    // Starvation histograms on, as in every batch.
+    {
+        Config cfg;
+        cfg.readers = 300;
+        cfg.writers = 300;
+        Metrics metrics(SEM_BUILTIN_COUNT);
+        sim.metrics = &metrics;
+        results.push_back(bench("scheduler_steps_600_metrics", scheduler_steps(cfg)));
+        sim.metrics = nullptr;
+    }
+
+    // The built-in protocol again, run from its protocol file by the bytecode interpreter.
+    Protocol protocol;
+    string error;
+    if (load_protocol(string(PROTOCOL_DIR) + "/readers_writers.txt", protocol, error)) {
+        Config cfg;
+        cfg.readers = 300;
+        cfg.writers = 300;
+        cfg.protocol = &protocol;
+        results.push_back(bench("scheduler_steps_600_protocol_file", scheduler_steps(cfg)));
+
+        // Fill the registry: every semaphore and read_count gets bounds, so most
+        // steps change something an invariant watches.
+        Protocol checked = protocol;
+        for (int i = 0; (int) checked.invariants.invariants.size() < MAX_INVARIANTS; i++) {
+            int var = i % 4 == 3 ? VAR_SHARED_BASE : i % 4;
+            Invariant inv{"bound_" + to_string(i), var_bit(var), compare_holds,
+                          {TERM_VAR, var}, {TERM_CONSTANT, -1000 - i}, CMP_GE};
+            add_invariant(checked.invariants, inv);
+        }
+        cfg.protocol = &checked;
+        results.push_back(bench("scheduler_steps_600_invariants_64", scheduler_steps(cfg)));
+    } else {
+        cerr << "skipping protocol benchmark: " << error << endl;
+    }
+
+    // The built-in programs again, as coroutines.
+    Config coroutines;
+    coroutines.readers = 300;
+    coroutines.writers = 300;
+    coroutines.coroutines = true;
+    results.push_back(bench("scheduler_steps_600_coroutines", scheduler_steps(coroutines)));
+
+    // One recorded 600-process run, replayed: same steps as scheduler_steps_600
+    // without the RNG or the ready-set picks.
+    {
+        Config cfg;
+        cfg.readers = 300;
+        cfg.writers = 300;
+        ScheduleLog log;
+        reset_simulation(sim, cfg);
+        sim.rng.seed(1, 0);
+        sim.schedule = &log;
+        run_simulation(sim);
+        sim.schedule = nullptr;
+        ScheduleFile file;
+        file.header.picks = log.picks;
+        file.bytes = log.bytes;
+        results.push_back(bench("replay_steps_600", [&](long n) {
+            long steps = 0;
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                steps += replay_schedule(sim, file, -1).steps;
+            }
+            return steps;
+        }));
+    }
+
+    // A million processes two million steps in, restored from a snapshot
+    // instead of re-simulating the prefix: map, copy columns, rebuild the graph.
+    {
+        Config cfg;
+        cfg.readers = 500000;
+        cfg.writers = 500000;
+        Config loaded = cfg;
+        const string path = "bench_snapshot.bin";
+        reset_simulation(sim, cfg);
+        sim.rng.seed(1, 0);
+        sim.pause_at = 2000000;
+        run_simulation(sim);
+        sim.pause_at = LONG_MAX;
+        save_snapshot(path, sim, cfg, 1);
+        results.push_back(bench("restore_1M_processes", [&](long n) {
+            for (long i = 0; i < n; i++) {
+                SnapshotFile file;
+                string error;
+                load_snapshot(path, loaded, file, error);
+                reset_simulation(sim, loaded);
+                restore_snapshot(sim, file);
+            }
+            return n * (cfg.readers + cfg.writers);
+        }));
+        results.push_back(bench("prefix_2M_steps_1M_processes", [&](long n) {
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                sim.rng.seed(1, 0);
+                sim.pause_at = 2000000;
+                run_simulation(sim);
+                sim.pause_at = LONG_MAX;
+            }
+            return n * (cfg.readers + cfg.writers);
+        }));
+        remove(path.c_str());
+    }
+
+    // The discrete-event engine, ops = events (steps): radix-heap pops and pushes
+    // on top of the step itself, with busy work drawing a random duration.
+    {
+        Config cfg;
+        cfg.readers = 30000;
+        cfg.writers = 30000;
+        cfg.durations[OP_BUSY] = {50, 150};
+        EventQueue events;
+        sim.events = &events;
+        sim.durations = &cfg.durations;
+        results.push_back(bench("clock_events_60000", [&](long n) {
+            long steps = 0;
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                sim.rng.seed(1, i);
+                steps += run_clocked(sim).steps;
             }
+            return steps;
+        }));
+        sim.events = nullptr;
+        sim.durations = nullptr;
+    }
+
+    // Timed waits giving up, ops = timeouts: one reader holds the only
+    // reader_limiter slot while the others' deadlines pass, so each expiry
+    // unlinks a pid from the middle of the wait queue and runs it to the end.
+    Protocol timed;
+    if (load_protocol(string(PROTOCOL_DIR) + "/timed_readers.txt", timed, error)) {
+        Config cfg;
+        cfg.readers = 60000;
+        cfg.writers = 0;
+        cfg.reader_limit = 1;
+        cfg.protocol = &timed;
+        cfg.durations[OP_BUSY] = {1000, 1000};
+        cfg.wait_timeout = 500;
+        EventQueue events;
+        TimerWheel timers;
+        sim.events = &events;
+        sim.timers = &timers;
+        sim.durations = &cfg.durations;
+        results.push_back(bench("timeouts_60000", [&](long n) {
+            long timeouts = 0;
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                sim.rng.seed(1, i);
+                timeouts += run_clocked(sim).timeouts;
+            }
+            return timeouts;
+        }));
+        sim.events = nullptr;
+        sim.timers = nullptr;
+        sim.durations = nullptr;
+    } else {
+        cerr << "skipping timeout benchmark: " << error << endl;
+    }
 
-            // Update completion count
-            if (processes[pid].status == FINISHED) {
-                completed++;
-                //  mark as BLOCKED
-                processes[pid].status = BLOCKED; // Remove from scheduling
+    // Whole six-process trials, ops = trials: the scalar loop against 16 lockstep lanes.
+    {
+        Config cfg;
+        results.push_back(bench("trials_6_scalar", [&](long n) {
+            for (long i = 0; i < n; i++) {
+                reset_simulation(sim, cfg);
+                sim.rng.seed(1, i);
+                run_simulation(sim);
             }
+            return n;
+        }));
+        results.push_back(bench("trials_6_lanes", [&](long n) {
+            TrialPool pool(n, 1);
+            BatchTotals totals;
+            run_lane_worker(pool, 0, cfg, 1, totals);
+            return n;
+        }));
+    }
+
+    // Whole verification runs, ops = runs: BFS over every state against DPOR,
+    // which skips orders of commuting steps. DPOR wins on the built-in 3R/3W
+    // and by far more when processes do private work (think_time.txt).
+    {
+        Config cfg;
+        cfg.readers = 3;
+        cfg.writers = 3;
+        Protocol think;
+        Config think_cfg;
+        think_cfg.readers = 2;
+        think_cfg.writers = 2;
+        think_cfg.protocol = &think;
+        bool have_think = load_protocol(string(PROTOCOL_DIR) + "/think_time.txt", think, error);
+        if (!have_think) cerr << "skipping think_time benchmarks: " << error << endl;
+        auto verify = [](const Config &c, bool (*search)(const Config &)) {
+            return [&c, search](long n) {
+                cout.setstate(ios::failbit); // the searches report on cout
+                for (long i = 0; i < n; i++) search(c);
+                cout.clear();
+                return n;
+            };
+        };
+        results.push_back(bench("verify_3r_3w_explore", verify(cfg, run_explorer)));
+        results.push_back(bench("verify_3r_3w_dpor", verify(cfg, run_dpor)));
+        if (have_think) {
+            results.push_back(bench("verify_think_time_2r_2w_explore", verify(think_cfg, run_explorer)));
+            results.push_back(bench("verify_think_time_2r_2w_dpor", verify(think_cfg, run_dpor)));
+        }
+    }
+
+    // A million suspended coroutine processes; once the pool is warm a reset
+    // recycles their frames instead of calling the allocator.
+    Config million = coroutines;
+    million.readers = 500000;
+    million.writers = 500000;
+    results.push_back(bench("reset_1M_coroutine_processes", [&](long n) {
+        for (long i = 0; i < n; i++) reset_simulation(sim, million);
+        return n * (million.readers + million.writers);
+    }));
+    cerr << "coroutine frames: " << frame_pool.live << " live, up to " << frame_pool.frame_bytes << " bytes each, "
+         << frame_pool.slabs.size() * FramePool::SLAB / (1 << 20) << " MiB of slabs" << endl;
+    return results;
+}
+
+void write_bench_json(const vector<BenchResult> &results, ostream &out) {
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+            << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+            << ", \"ns_per_op\": " << r.seconds * 1e9 / r.ops
+            << ", \"ops_per_second\": " << r.ops / r.seconds << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Usage: Project_3_bench [--out PATH]   (JSON to stdout by default)
+int main(int argc, char **argv) {
+    vector<BenchResult> results = run_benchmarks();
+    if (argc == 3 && string(argv[1]) == "--out") {
+        ofstream out(argv[2]);
+        write_bench_json(results, out);
+        return out ? 0 : 1;
+    }
+    write_bench_json(results, cout);
+    return 0;
+}
+
+#endif
+
+///// ---  BENCHMARKS END ----- /////
+
+#ifndef SIM_BENCHMARK
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    uint64_t seed = config.seed_given ? config.seed : (uint64_t) time(0);
+
+    Protocol protocol;
+    if (!config.protocol_file.empty()) {
+        string error;
+        if (!load_protocol(config.protocol_file, protocol, error)) {
+            cout << "Protocol error: " << error << endl;
+            return 1;
+        }
+        config.protocol = &protocol;
+    }
+    const vector<string> *sem_names = config.protocol ? &protocol.sem_names : nullptr;
+    const InvariantSet *invariants = config.protocol ? &protocol.invariants : &BUILTIN_INVARIANTS;
+    if (!config.decode_file.empty()) return decode_trace(config.decode_file.c_str(), sem_names, invariants) ? 0 : 1;
+
+    // Each of these picks what the run does; refuse combinations rather than ignore all but one.
+    vector<const char *> modes;
+    for (auto [given, flag] : {pair{config.explore, "--explore"}, {config.dpor, "--dpor"}, {config.threads, "--threads"},
+                               {!config.sweep.empty(), "--sweep"}, {config.compare_wake, "--compare-wake"},
+                               {config.lanes, "--lanes"}}) {
+        if (given) modes.push_back(flag);
+    }
+    if (modes.size() > 1) {
+        for (size_t i = 0; i < modes.size(); i++) {
+            cout << (i == 0 ? "" : i + 1 < modes.size() ? ", " : " and ") << modes[i];
+        }
+        cout << " cannot be combined; pick one." << endl;
+        return 1;
+    }
+    if ((!modes.empty() || config.trials > 0)
+        && (!config.record_file.empty() || !config.replay_file.empty() || !config.snapshot_file.empty()
+            || !config.restore_file.empty())) {
+        cout << "--record, --replay, --snapshot and --restore apply to a single run only." << endl;
+        return 1;
+    }
+    if (!config.restore_file.empty() && !config.record_file.empty()) {
+        cout << "A schedule recorded after --restore lacks its starting state and cannot be replayed; drop --record." << endl;
+        return 1;
+    }
+    if (!config.replay_file.empty()
+        && (!config.record_file.empty() || !config.snapshot_file.empty() || !config.restore_file.empty())) {
+        cout << "--replay reruns a recorded schedule from the start; it cannot be combined with --record, --snapshot or --restore." << endl;
+        return 1;
+    }
+
+    if (config.coroutines && (config.protocol || config.explore || config.dpor || config.threads)) {
+        cout << "--coroutines runs the built-in programs in sampled runs (single or --trials) only." << endl;
+        return 1;
+    }
+    if (config.coroutines && (!config.snapshot_file.empty() || !config.restore_file.empty())) {
+        cout << "Coroutine frames cannot be snapshotted; drop --coroutines." << endl;
+        return 1;
+    }
+
+    if (config.clock && (config.explore || config.dpor || config.threads || config.lanes || config.run_to_block
+                         || !config.sweep.empty() || !config.record_file.empty() || !config.replay_file.empty()
+                         || !config.snapshot_file.empty() || !config.restore_file.empty())) {
+        cout << "--clock runs plain sampled runs (single or --trials) only." << endl;
+        return 1;
+    }
+    string wake_error;
+    if (!resolve_wake(config, wake_error)) {
+        cout << "Wake policy error: " << wake_error << endl;
+        return 1;
+    }
+    if ((!config.wake.empty() || config.compare_wake)
+        && (config.explore || config.dpor || config.threads || config.lanes || !config.record_file.empty()
+            || !config.replay_file.empty() || !config.snapshot_file.empty() || !config.restore_file.empty())) {
+        cout << "Wake policies apply to plain sampled runs (single, --trials, --sweep) only." << endl;
+        return 1;
+    }
+    if (config.protocol && config.protocol->timed_waits && !config.clock) {
+        cout << "wait_timed deadlines are in virtual time; add --clock." << endl;
+        return 1;
+    }
+
+    if (config.explore) return run_explorer(config) ? 0 : 1;
+    if (config.dpor) return run_dpor(config) ? 0 : 1;
+    if (config.threads) return run_threads(config) ? 0 : 1;
+
+    if (!config.sweep.empty()) {
+        run_sweep(config, seed);
+        return 0;
+    }
+    if (config.compare_wake) {
+        run_wake_comparison(config, seed);
+        return 0;
+    }
+    if (config.lanes) {
+        if (config.trials == 0 || config.protocol || config.coroutines || config.run_to_block
+            || config.readers + config.writers > LANE_MAX_PROCESSES) {
+            cout << "--lanes runs --trials of the built-in programs, without --run-to-block, on up to "
+                 << LANE_MAX_PROCESSES << " processes." << endl;
+            return 1;
+        }
+        run_lanes(config, seed);
+        return 0;
+    }
+    if (config.trials > 0) {
+        run_batch(config, seed);
+        return 0;
+    }
+
+    ScheduleFile replay;
+    if (!config.replay_file.empty()) {
+        string error;
+        if (!load_schedule(config.replay_file, config, replay, error)) {
+            cout << "Replay error: " << error << endl;
+            return 1;
+        }
+        seed = replay.header.seed;
+    }
+    // Without --seed the restored run carries on exactly; with it, it forks onto a new RNG stream.
+    SnapshotFile snapshot;
+    if (!config.restore_file.empty()) {
+        string error;
+        if (!load_snapshot(config.restore_file, config, snapshot, error)) {
+            cout << "Restore error: " << error << endl;
+            return 1;
         }
+        if (!config.seed_given) {
+            seed = snapshot.header.seed;
+            config.trial = snapshot.header.trial;
+        }
+    }
+
+    Trace trace;
+    FILE *trace_out = stdout;
+    if (config.trace == TRACE_BINARY) {
+        trace_out = fopen(config.trace_file.c_str(), "wb");
+        if (!trace_out) {
+            cout << "Cannot write trace " << config.trace_file << endl;
+            return 1;
+        }
+    }
+    trace_open(trace, config.trace, trace_out, seed);
+    trace.sem_names = sem_names;
+    trace.invariants = invariants;
+
+    vector<string> all_sem_names = semaphore_names(config);
+    Metrics metrics((int) all_sem_names.size());
+    Simulation sim;
+    sim.metrics = &metrics;
+    EventQueue events;
+    TimerWheel timers;
+    if (config.clock) {
+        sim.events = &events;
+        sim.timers = &timers;
+        sim.durations = &config.durations;
+    }
+    reset_simulation(sim, config);
+    if (snapshot.data) {
+        restore_snapshot(sim, snapshot);
+        cout << "Restored step " << sim.steps << " from " << config.restore_file << endl;
+    }
+    if (!snapshot.data || config.seed_given) seed_trial(sim, seed, config.trial);
+    if (config.trace != TRACE_NONE) sim.trace = &trace;
+    ScheduleLog log;
+    if (!config.record_file.empty()) sim.schedule = &log;
+    TrialResult result{};
+    if (!config.snapshot_file.empty()) {
+        sim.pause_at = config.snapshot_at;
+        result = run_simulation(sim);
+        sim.pause_at = LONG_MAX;
+        trace_flush(trace);
+        if (!save_snapshot(config.snapshot_file, sim, config, seed)) {
+            cout << "Cannot write snapshot " << config.snapshot_file << endl;
+            return 1;
+        }
+        cout << "Step " << sim.steps << " saved to " << config.snapshot_file
+             << " (continue with --restore " << config.snapshot_file << ")" << endl;
+    }
+    if (config.clock) result = run_clocked(sim);
+    else if (!result.deadlocked) result = config.replay_file.empty() ? run_simulation(sim) : replay_schedule(sim, replay, config.stop_at);
+    trace_flush(trace);
+    if (trace_out != stdout) {
+        fclose(trace_out);
+        cout << trace.events << " events written to " << config.trace_file
+             << " (decode with --decode " << config.trace_file << ")" << endl;
+    }
+    cout << "Seed: " << seed << ", trial: " << config.trial << endl;
+    if (!config.record_file.empty()) {
+        if (!save_schedule(config.record_file, config, seed, log)) {
+            cout << "Cannot write schedule " << config.record_file << endl;
+            return 1;
+        }
+        cout << log.picks << " scheduler picks (" << log.bytes.size() << " bytes) recorded to " << config.record_file
+             << " (replay with --replay " << config.record_file << ")" << endl;
     }
+    if (!replay.error.empty()) {
+        cout << "Replay error: " << replay.error << endl;
+        return 1;
+    }
+    if (replay.stopped) {
+        cout << "Stopped at step " << sim.steps << " after " << replay.replayed << " of " << replay.header.picks
+             << " scheduler picks" << endl;
+        print_state(sim, config);
+        return 0;
+    }
+    if (config.clock) {
+        long finished = count(sim.processes.status.begin(), sim.processes.status.end(), FINISHED);
+        cout << "Virtual time: " << result.time << " (" << 1000.0 * finished / max(result.time, 1L)
+             << " processes finished per 1000 time units)" << endl;
+        if (config.protocol && config.protocol->timed_waits) cout << "Timed-out waits: " << result.timeouts << endl;
+    }
+    print_metrics(metrics, all_sem_names, config.clock ? "virtual time units" : "scheduler steps");
+    if (result.deadlocked) return 1;
 
     cout << "DONE !!!" << endl;
     return 0; ///
-}
\ No newline at end of file
+}
+#endif
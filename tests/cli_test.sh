@@ -0,0 +1,126 @@
+#!/bin/sh
+# Command-line regression checks, one ctest entry per case (see CMakeLists.txt).
+# Usage: cli_test.sh SIM CASE [ARGS...]
+#   verdict verified|deadlock|needs-clock ARGS...  --explore/--dpor ARGS reach that verdict
+#   verdict completes ARGS...                      every one of the --trials ARGS completes
+#   record_replay                                  replaying a recorded run reproduces it
+#   corrupt_snapshot, corrupt_schedule             damaged files are refused, not crashed on
+set -u
+sim=$1
+name=$2
+shift 2
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Run sim with the given arguments; output in $work/out, exit status in $rc.
+run() {
+    "$sim" "$@" > "$work/out" 2>&1
+    rc=$?
+}
+
+# Run sim and insist on exit status $1 and an output line matching $2.
+expect() {
+    status=$1 pattern=$2
+    shift 2
+    run "$@"
+    [ "$rc" -eq "$status" ] && grep -q "$pattern" "$work/out" && return
+    cat "$work/out"
+    fail "'$*' exited $rc, expected $status with output matching '$pattern'"
+}
+
+# Overwrite bytes of file $1 at offset $2 with the printf escapes in $3.
+poke() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# Copy file $1 to $2, keeping only its first $3 bytes.
+truncated() {
+    head -c "$3" "$1" > "$2"
+}
+
+# Every damaged copy of $1 made by $2 must be refused with $3, by a clean exit 1.
+refuse_all() {
+    for damaged in "$work"/bad_*; do
+        expect 1 "$2" "$1" "$damaged"
+        rm "$damaged"
+    done
+}
+
+case "$name" in
+verdict)
+    verdict=$1
+    shift
+    case "$verdict" in
+    verified) expect 0 "^VERIFIED" "$@" ;;
+    deadlock) expect 1 "^DEADLOCK: " "$@" ;;
+    needs-clock) expect 1 "add --clock" "$@" ;;
+    completes) expect 0 "^Deadlocked trials: 0$" "$@" ;;
+    *) fail "unknown verdict $verdict" ;;
+    esac
+    ;;
+
+record_replay)
+    # Built-in programs, a protocol with run-to-block, and a run that deadlocks.
+    for args in "--seed 7" "--seed 3 --readers 4 --writers 2 --run-to-block" \
+        "--seed 11 --protocol $(dirname "$0")/../protocols/ab_ba_deadlock.txt"; do
+        args="$args --trace-file $work/trace.bin"
+        # shellcheck disable=SC2086
+        run $args --record "$work/run.bin"
+        recorded=$rc
+        grep -v "recorded to" "$work/out" > "$work/recorded"
+        # shellcheck disable=SC2086
+        run $args --replay "$work/run.bin"
+        [ "$rc" -eq "$recorded" ] || fail "'$args': replay exited $rc, the recorded run $recorded"
+        diff "$work/recorded" "$work/out" > /dev/null || {
+            diff "$work/recorded" "$work/out"
+            fail "'$args': replay differs from the recorded run"
+        }
+    done
+    ;;
+
+corrupt_snapshot)
+    expect 0 "saved to" --seed 5 --trace none --snapshot "$work/good.bin" --snapshot-at 10
+    good=$work/good.bin
+    size=$(wc -c < "$good")
+    : > "$work/bad_empty"
+    truncated "$good" "$work/bad_header" 40
+    truncated "$good" "$work/bad_body" $((size - 8))
+    cp "$good" "$work/bad_longer" && printf 'xxxx' >> "$work/bad_longer"
+    cp "$good" "$work/bad_magic" && poke "$work/bad_magic" 0 'XXXX'
+    cp "$good" "$work/bad_version" && poke "$work/bad_version" 4 '\377'
+    cp "$good" "$work/bad_readers" && poke "$work/bad_readers" 8 '\377\377\377\177'
+    cp "$good" "$work/bad_negative" && poke "$work/bad_negative" 12 '\377\377\377\377'
+    cp "$good" "$work/bad_limit" && poke "$work/bad_limit" 16 '\0\0\0\0'
+    cp "$good" "$work/bad_semaphores" && poke "$work/bad_semaphores" 22 '\377'
+    refuse_all --restore "Restore error"
+    expect 1 "Restore error" --restore "$work/missing.bin"
+    ;;
+
+corrupt_schedule)
+    expect 0 "recorded to" --seed 5 --trace none --record "$work/good.bin"
+    good=$work/good.bin
+    size=$(wc -c < "$good")
+    : > "$work/bad_empty"
+    truncated "$good" "$work/bad_header" 20
+    truncated "$good" "$work/bad_picks" $((size - 1))
+    cp "$good" "$work/bad_magic" && poke "$work/bad_magic" 0 'XXXX'
+    cp "$good" "$work/bad_readers" && poke "$work/bad_readers" 8 '\377\377\377\377'
+    cp "$good" "$work/bad_population" && poke "$work/bad_population" 8 '\0\0\0\177\0\0\0\177'
+    cp "$good" "$work/bad_flags" && poke "$work/bad_flags" 20 '\2'
+    cp "$good" "$work/bad_bytes" && poke "$work/bad_bytes" 55 '\177'
+    cp "$good" "$work/bad_varint" && poke "$work/bad_varint" 56 '\377\377\377\377\377\377'
+    cp "$good" "$work/bad_pick" && poke "$work/bad_pick" 56 '\176'
+    refuse_all --replay "Replay error"
+    expect 1 "Replay error" --replay "$work/missing.bin"
+    ;;
+
+*)
+    fail "unknown case $name"
+    ;;
+esac
+echo "PASS: $name"